@@ -0,0 +1,838 @@
+/**********************************************
+ ** File: bench.cpp
+ ** Project: CMSC 341 Project 4
+ **
+ ** This file benchmarks the car database under configurable workloads, for each probing policy and hash function.
+ ** Build: g++ -std=c++17 -O2 dealer.cpp bench.cpp -o bench -lpthread, add -DCARDB_STATS for the probe counts
+ ** Usage: bench [--mode mixed|concurrent|probes|migration|batch] [--sizes 1000,100000,1000000] [--ops 200000]
+ **              [--mix insert,getCar,update,remove] [--dist uniform|normal|zipf] [--skew 0.99] [--load 0.45]
+ **              [--policies QUADRATIC,DOUBLEHASH,GROUPED,ROBINHOOD] [--hashes hashCode,hashCodeView,wyHash]
+ **              [--threads 1,2,4,8,16] [--shards 16] [--batches 8,16,32,64,128,256,512,1024] [--output bench_output.txt]
+ ** mixed runs the operations on a CarDB from one thread. concurrent splits the same operations between
+ ** each number of threads on a ConcurrentCarDB, --mix 0,100,0,0 measures how the lock-free reads scale.
+ ** probes times lookups that all miss, and with CARDB_STATS divides the time by the probes they took:
+ ** QUADRATIC and DOUBLEHASH probe one bucket at a time, GROUPED and ROBINHOOD probe linearly a group at a time.
+ ** --load fills its table to that load factor, a load above the policy's limit grows the table.
+ ** migration stops an incremental rehash half way with setMigrationBudget and times hits on keys whose old home
+ ** bucket is behind the migration cursor and ahead of it, then the same keys once the migration is done.
+ ** batch looks up the same keys with getCars, which prefetches their buckets, and with one findCar per key,
+ ** for each batch size.
+ ** Every run appends one JSON line to the output file, the same results are printed as a table.
+ ************************************************************************/
+
+#include "dealer.h"
+#include "hashcode.h"
+#include "random.h"
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <malloc.h>
+#include <thread>
+#include <atomic>
+#include <array>
+
+const int NUMOPS = 4; // insert, getCar, updateQuantity and remove
+const char* OPNAMES[NUMOPS] = {"insert", "getCar", "updateQuantity", "remove"};
+const int MIGRATIONBUDGET = 8; // old buckets per rehash step while the migration mode moves its cursor
+
+// Settings of a benchmark, filled in from the command line
+struct BenchConfig{
+    string m_mode = "mixed";                         // mixed, concurrent, probes, migration or batch
+    vector<int> m_sizes = {1000, 100000, 1000000};  // cars loaded before the mixed operations
+    long long m_ops = 200000;                        // mixed operations per run
+    int m_mix[NUMOPS] = {10, 70, 15, 5};             // percent of each operation, in the order of OPNAMES
+    RANDOM m_dist = ZIPF;                            // distribution of the keys the operations pick
+    double m_skew = 0.99;                            // skew of ZIPF
+    vector<prob_t> m_policies = {QUADRATIC, DOUBLEHASH, GROUPED, ROBINHOOD};
+    vector<string> m_hashes = {"hashCode", "hashCodeView", "wyHash"};
+    vector<int> m_threads = {1, 2, 4, 8, 16};        // thread counts of the concurrent mode
+    int m_shards = 16;                               // shards of the ConcurrentCarDB
+    double m_load = 0;                               // load the probes mode sizes the table for, 0 to let it grow
+    vector<int> m_batches = {8, 16, 32, 64, 128, 256, 512, 1024}; // keys per getCars call of the batch mode
+    string m_output = "bench_output.txt";
+};
+
+// Latencies of one kind of operation in a run, in nanoseconds
+struct OpLatencies{
+    vector<float> m_nanos;
+
+    // percentile(double fraction)
+    // Returns the latency below which the fraction of the operations fall, m_nanos must be sorted
+    float percentile(double fraction) const {
+        if (m_nanos.empty()) {
+            return 0;
+        }
+        size_t index = static_cast<size_t>(fraction * (m_nanos.size() - 1));
+        return m_nanos[index];
+    }
+};
+
+// policyName(prob_t policy)
+// Returns the name of the policy as written in the results
+static string policyName(prob_t policy) {
+    switch (policy) {
+        case QUADRATIC:  return "QUADRATIC";
+        case DOUBLEHASH: return "DOUBLEHASH";
+        case GROUPED:    return "GROUPED";
+        case ROBINHOOD:  return "ROBINHOOD";
+        default:         return "NONE";
+    }
+}
+
+// distName(RANDOM dist)
+// Returns the name of the key distribution as written in the results
+static string distName(RANDOM dist) {
+    return dist == ZIPF ? "zipf" : dist == NORMAL ? "normal" : "uniform";
+}
+
+// heapBytes()
+// Returns the bytes currently allocated on the heap, including the large blocks mapped on their own
+static size_t heapBytes() {
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+// makeDB(const string& hash, prob_t policy, int capacity = MINPRIME)
+// Creates an empty database with the named hash function, nullptr if the name is unknown
+static CarDB* makeDB(const string& hash, prob_t policy, int capacity = MINPRIME) {
+    if (hash == "hashCode") {
+        return new CarDB(capacity, hashCode, policy);
+    } else if (hash == "hashCodeView") {
+        return new CarDB(capacity, hashCodeView, policy);
+    } else if (hash == "wyHash") {
+        return new CarDB(capacity, wyHash, policy);
+    }
+    return nullptr;
+}
+
+// makeConcurrentDB(const string& hash, prob_t policy, int shards)
+// Creates an empty concurrent database with the named hash function, nullptr if the name is unknown
+static ConcurrentCarDB* makeConcurrentDB(const string& hash, prob_t policy, int shards) {
+    if (hash == "hashCode") {
+        return new ConcurrentCarDB(shards, MINPRIME, hashCode, policy);
+    } else if (hash == "hashCodeView") {
+        return new ConcurrentCarDB(shards, MINPRIME, hashCodeView, policy);
+    } else if (hash == "wyHash") {
+        return new ConcurrentCarDB(shards, MINPRIME, wyHash, policy);
+    }
+    return nullptr;
+}
+
+// hashOf(const string& hash, const string& model)
+// Returns the hash the named hash function gives the model, as the database computes it
+static unsigned int hashOf(const string& hash, const string& model) {
+    if (hash == "hashCode") {
+        return hashCode(model);
+    } else if (hash == "hashCodeView") {
+        return hashCodeView(model);
+    }
+    return wyHash(model);
+}
+
+// modelOf(int key)
+// Returns the model of a key, each key is a model of its own sold by the dealer dealerOf(key)
+static string modelOf(int key) {
+    return "Model" + to_string(key);
+}
+
+// dealerOf(int key)
+// Returns the dealer id of a key
+static int dealerOf(int key) {
+    return MINID + key % (MAXID - MINID + 1);
+}
+
+// reportLatencies(OpLatencies latencies[NUMOPS], ostringstream& json)
+// Sorts the latencies of each operation, appends their percentiles to the JSON line
+// and prints the p50 and p99 columns of the table
+static void reportLatencies(OpLatencies latencies[NUMOPS], ostringstream& json) {
+    char line[64];
+    for (int op = 0; op < NUMOPS; op++) {
+        OpLatencies& latency = latencies[op];
+        sort(latency.m_nanos.begin(), latency.m_nanos.end());
+        json << ",\"" << OPNAMES[op] << "\":{\"count\":" << latency.m_nanos.size()
+             << ",\"p50\":" << latency.percentile(0.5) << ",\"p90\":" << latency.percentile(0.9)
+             << ",\"p99\":" << latency.percentile(0.99) << ",\"p999\":" << latency.percentile(0.999)
+             << ",\"max\":" << latency.percentile(1.0) << "}";
+        snprintf(line, sizeof(line), " %9.0f %9.0f", latency.percentile(0.5), latency.percentile(0.99));
+        cout << line;
+    }
+}
+
+// runOne(const BenchConfig& config, int size, prob_t policy, const string& hash, ofstream& results)
+// Loads size cars in a shuffled order, then runs the mixed operations on keys drawn from the distribution
+// Prints a line of the table and appends the JSON line of the run to results
+static bool runOne(const BenchConfig& config, int size, prob_t policy, const string& hash, ofstream& results) {
+    // Load order, shuffled with a fixed seed so the runs are repeatable
+    vector<int> order;
+    Random shuffler(0, size - 1, SHUFFLE);
+    shuffler.setSeed(10);
+    shuffler.getShuffle(order);
+    vector<string> models(size);
+    for (int key = 0; key < size; key++) {
+        models[key] = modelOf(key);
+    }
+
+    size_t heapBefore = heapBytes();
+    CarDB* db = makeDB(hash, policy);
+    if (!db) {
+        cout << "Unknown hash function " << hash << endl;
+        return false;
+    }
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < size; i++) {
+        int key = order[i];
+        db->insert(Car(models[key], 1, dealerOf(key), true));
+    }
+    double loadSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    double bytesPerEntry = static_cast<double>(heapBytes() - heapBefore) / size;
+
+    // Mixed phase: the distribution picks a rank, the load order maps it to a key,
+    // so the most frequent keys are spread over the table instead of being neighbors
+    Random keys(0, size - 1, config.m_dist, size / 2, size / 6 + 1);
+    if (config.m_dist == ZIPF) {
+        keys.setSkew(config.m_skew);
+    }
+    Random ops(0, 99);
+    OpLatencies latencies[NUMOPS];
+    for (int op = 0; op < NUMOPS; op++) {
+        latencies[op].m_nanos.reserve(config.m_ops * config.m_mix[op] / 100 + 16);
+    }
+    int nextKey = size;  // inserts add keys that were never loaded
+    vector<int> removed; // loaded keys removed in the mixed phase, inserted again before any new key
+    long long succeeded = 0; // also keeps the calls from being optimized away
+
+    start = chrono::steady_clock::now();
+    for (long long i = 0; i < config.m_ops; i++) {
+        int pick = ops.getRandNum();
+        int op = 0;
+        while (op < NUMOPS - 1 && pick >= config.m_mix[op]) {
+            pick -= config.m_mix[op];
+            op++;
+        }
+        int key = order[keys.getRandNum()];
+
+        // The arguments are built before the clock starts
+        // Inserts bring the removed keys back, so removing hot keys does not turn the later operations into misses
+        if (op == 0) {
+            int insertKey = nextKey;
+            if (!removed.empty()) {
+                insertKey = removed.back();
+                removed.pop_back();
+            } else {
+                nextKey++;
+            }
+            Car car(insertKey < size ? models[insertKey] : modelOf(insertKey), 1, dealerOf(insertKey), true);
+            auto begin = chrono::steady_clock::now();
+            succeeded += db->insert(std::move(car));
+            latencies[op].m_nanos.push_back(chrono::duration<float, nano>(chrono::steady_clock::now() - begin).count());
+        } else {
+            const string& model = models[key];
+            int dealer = dealerOf(key);
+            bool done;
+            auto begin = chrono::steady_clock::now();
+            if (op == 1) {
+                done = db->getCar(model, dealer).getUsed();
+            } else if (op == 2) {
+                done = db->updateQuantity(model, dealer, static_cast<int>(i));
+            } else {
+                done = db->remove(model, dealer);
+            }
+            latencies[op].m_nanos.push_back(chrono::duration<float, nano>(chrono::steady_clock::now() - begin).count());
+            succeeded += done;
+            if (op == 3 && done) {
+                removed.push_back(key);
+            }
+        }
+    }
+    double mixedSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    delete db;
+
+    // Table line, then the JSON line
+    char line[256];
+    snprintf(line, sizeof(line), "%-9d %-11s %-13s %12.0f %12.0f %10.1f", size, policyName(policy).c_str(), hash.c_str(),
+             size / loadSeconds, config.m_ops / mixedSeconds, bytesPerEntry);
+    cout << line;
+
+    ostringstream json;
+    json << "{\"mode\":\"mixed\",\"size\":" << size << ",\"policy\":\"" << policyName(policy) << "\",\"hash\":\"" << hash
+         << "\",\"dist\":\"" << distName(config.m_dist) << "\",\"skew\":" << (config.m_dist == ZIPF ? config.m_skew : 0)
+         << ",\"mix\":[" << config.m_mix[0] << "," << config.m_mix[1] << "," << config.m_mix[2] << "," << config.m_mix[3] << "]"
+         << ",\"ops\":" << config.m_ops << ",\"succeeded\":" << succeeded
+         << ",\"loadOpsPerSec\":" << static_cast<long long>(size / loadSeconds)
+         << ",\"opsPerSec\":" << static_cast<long long>(config.m_ops / mixedSeconds)
+         << ",\"bytesPerEntry\":" << bytesPerEntry;
+    reportLatencies(latencies, json);
+    json << "}";
+    cout << endl;
+    results << json.str() << endl;
+    return true;
+}
+
+// runConcurrent(const BenchConfig& config, int size, prob_t policy, const string& hash, int threads,
+//               double& baseline, ofstream& results)
+// Loads size cars into a ConcurrentCarDB, then splits the mixed operations evenly between the threads
+// The operations and keys are drawn from one seeded generator before the clock starts and cut into one slice
+// per thread, so every thread count runs the same operations; baseline is the throughput of the first
+// thread count, the others report their speedup over it
+static bool runConcurrent(const BenchConfig& config, int size, prob_t policy, const string& hash, int threads,
+                          double& baseline, ofstream& results) {
+    vector<int> order;
+    Random shuffler(0, size - 1, SHUFFLE);
+    shuffler.setSeed(10);
+    shuffler.getShuffle(order);
+    vector<string> models(size);
+    for (int key = 0; key < size; key++) {
+        models[key] = modelOf(key);
+    }
+    ConcurrentCarDB* db = makeConcurrentDB(hash, policy, config.m_shards);
+    if (!db) {
+        cout << "Unknown hash function " << hash << endl;
+        return false;
+    }
+    for (int i = 0; i < size; i++) {
+        int key = order[i];
+        db->insert(Car(models[key], 1, dealerOf(key), true));
+    }
+
+    // The operation and key of every call, thread t takes the calls [t * perThread, (t + 1) * perThread)
+    Random keys(0, size - 1, config.m_dist, size / 2, size / 6 + 1);
+    if (config.m_dist == ZIPF) {
+        keys.setSkew(config.m_skew);
+    }
+    Random ops(0, 99);
+    long long perThread = config.m_ops / threads;
+    vector<pair<int, int>> calls(perThread * threads);
+    for (auto& call : calls) {
+        int pick = ops.getRandNum();
+        int op = 0;
+        while (op < NUMOPS - 1 && pick >= config.m_mix[op]) {
+            pick -= config.m_mix[op];
+            op++;
+        }
+        call = {op, order[keys.getRandNum()]};
+    }
+
+    // Every thread waits for the start signal, so the clock covers only the calls
+    vector<array<OpLatencies, NUMOPS>> latencies(threads);
+    vector<long long> succeeded(threads, 0);
+    atomic<int> ready(0);
+    atomic<bool> go(false);
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            int nextKey = size + t;  // new keys of thread t, no other thread inserts them
+            vector<int> removed;     // keys this thread removed, inserted again before any new key
+            array<OpLatencies, NUMOPS>& latency = latencies[t];
+            for (int op = 0; op < NUMOPS; op++) {
+                latency[op].m_nanos.reserve(perThread * config.m_mix[op] / 100 + 16);
+            }
+            ready++;
+            while (!go.load()) {
+                this_thread::yield();
+            }
+            for (long long i = t * perThread; i < (t + 1) * perThread; i++) {
+                int op = calls[i].first;
+                int key = calls[i].second;
+                bool done;
+                if (op == 0) {
+                    int insertKey = nextKey;
+                    if (!removed.empty()) {
+                        insertKey = removed.back();
+                        removed.pop_back();
+                    } else {
+                        nextKey += threads;
+                    }
+                    Car car(insertKey < size ? models[insertKey] : modelOf(insertKey), 1, dealerOf(insertKey), true);
+                    auto begin = chrono::steady_clock::now();
+                    done = db->insert(car);
+                    latency[op].m_nanos.push_back(chrono::duration<float, nano>(chrono::steady_clock::now() - begin).count());
+                } else {
+                    const string& model = models[key];
+                    int dealer = dealerOf(key);
+                    auto begin = chrono::steady_clock::now();
+                    if (op == 1) {
+                        done = db->getCar(model, dealer).getUsed();
+                    } else if (op == 2) {
+                        done = db->updateQuantity(model, dealer, static_cast<int>(i));
+                    } else {
+                        done = db->remove(model, dealer);
+                    }
+                    latency[op].m_nanos.push_back(chrono::duration<float, nano>(chrono::steady_clock::now() - begin).count());
+                    if (op == 3 && done) {
+                        removed.push_back(key);
+                    }
+                }
+                succeeded[t] += done;
+            }
+        });
+    }
+    while (ready.load() < threads) {
+        this_thread::yield();
+    }
+    auto start = chrono::steady_clock::now();
+    go = true;
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    delete db;
+
+    // Merges the threads' latencies and counts
+    OpLatencies merged[NUMOPS];
+    long long total = 0;
+    for (int t = 0; t < threads; t++) {
+        total += succeeded[t];
+        for (int op = 0; op < NUMOPS; op++) {
+            vector<float>& nanos = latencies[t][op].m_nanos;
+            merged[op].m_nanos.insert(merged[op].m_nanos.end(), nanos.begin(), nanos.end());
+        }
+    }
+    double opsPerSec = calls.size() / seconds;
+    if (baseline == 0) {
+        baseline = opsPerSec;
+    }
+
+    char line[256];
+    snprintf(line, sizeof(line), "%-9d %-11s %-13s %7d %12.0f %7.2f", size, policyName(policy).c_str(), hash.c_str(),
+             threads, opsPerSec, opsPerSec / baseline);
+    cout << line;
+    ostringstream json;
+    json << "{\"mode\":\"concurrent\",\"size\":" << size << ",\"policy\":\"" << policyName(policy)
+         << "\",\"hash\":\"" << hash << "\",\"threads\":" << threads << ",\"shards\":" << config.m_shards
+         << ",\"cores\":" << thread::hardware_concurrency()
+         << ",\"dist\":\"" << distName(config.m_dist) << "\",\"skew\":" << (config.m_dist == ZIPF ? config.m_skew : 0)
+         << ",\"mix\":[" << config.m_mix[0] << "," << config.m_mix[1] << "," << config.m_mix[2] << "," << config.m_mix[3] << "]"
+         << ",\"ops\":" << calls.size() << ",\"succeeded\":" << total
+         << ",\"opsPerSec\":" << static_cast<long long>(opsPerSec) << ",\"speedup\":" << opsPerSec / baseline;
+    reportLatencies(merged, json);
+    json << "}";
+    cout << endl;
+    results << json.str() << endl;
+    return true;
+}
+
+// runProbes(const BenchConfig& config, int size, prob_t policy, const string& hash, ofstream& results)
+// Loads size cars, then times config.m_ops lookups of keys that were never inserted
+// When config.m_load is set the table is created for size cars at that load, and since capacities are picked
+// from a list of primes it is filled with as many cars as reach the load instead
+// Every lookup walks its whole probe sequence up to a never used bucket, so the time per probe is the cost of
+// one step of the policy; the probes are only counted when built with CARDB_STATS
+static bool runProbes(const BenchConfig& config, int size, prob_t policy, const string& hash, ofstream& results) {
+    CarDB* db = makeDB(hash, policy, config.m_load > 0 ? static_cast<int>(size / config.m_load) : MINPRIME);
+    if (!db) {
+        cout << "Unknown hash function " << hash << endl;
+        return false;
+    }
+    if (config.m_load > 0) {
+        size = static_cast<int>(config.m_load * db->stats().m_capacity);
+    }
+    vector<int> order;
+    Random shuffler(0, size - 1, SHUFFLE);
+    shuffler.setSeed(10);
+    shuffler.getShuffle(order);
+    for (int i = 0; i < size; i++) {
+        db->insert(Car(modelOf(order[i]), 1, dealerOf(order[i]), true));
+    }
+    
+    // Keys past the loaded ones all miss, built before the clock starts
+    vector<string> models(config.m_ops);
+    for (long long i = 0; i < config.m_ops; i++) {
+        models[i] = modelOf(size + static_cast<int>(i));
+    }
+    CarDBStats before = db->stats();
+    long long found = 0; // stays 0, also keeps the lookups from being optimized away
+    auto start = chrono::steady_clock::now();
+    for (long long i = 0; i < config.m_ops; i++) {
+        found += db->findCar(models[i], dealerOf(size + static_cast<int>(i))) != nullptr;
+    }
+    double nanos = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+    CarDBStats after = db->stats();
+    delete db;
+    
+    long long probes = after.m_probes.m_probes - before.m_probes.m_probes;
+    double nanosPerMiss = nanos / config.m_ops;
+    double probesPerMiss = static_cast<double>(probes) / config.m_ops;
+    double nanosPerProbe = probes > 0 ? nanos / probes : 0;
+    double load = static_cast<double>(after.m_live + after.m_deleted) / after.m_capacity;
+    int bucketsPerProbe = policy == GROUPED || policy == ROBINHOOD ? GROUPWIDTH : 1;
+    
+    char line[256];
+    snprintf(line, sizeof(line), "%-9d %-11s %-13s %6.2f %11.1f %12.2f %12.2f %8d", size, policyName(policy).c_str(),
+             hash.c_str(), load, nanosPerMiss, probesPerMiss, nanosPerProbe, bucketsPerProbe);
+    cout << line << endl;
+    results << "{\"mode\":\"probes\",\"size\":" << size << ",\"policy\":\"" << policyName(policy) << "\",\"hash\":\""
+            << hash << "\",\"stats\":" << (STATSENABLED ? "true" : "false") << ",\"load\":" << load
+            << ",\"misses\":" << config.m_ops - found << ",\"nanosPerMiss\":" << nanosPerMiss
+            << ",\"probesPerMiss\":" << probesPerMiss << ",\"nanosPerProbe\":" << nanosPerProbe
+            << ",\"bucketsPerProbe\":" << bucketsPerProbe << "}" << endl;
+    return true;
+}
+
+// timeHits(CarDB* db, const vector<int>& keys, OpLatencies& latency)
+// Looks every key up once and records the time of each lookup, returns the number found
+static long long timeHits(CarDB* db, const vector<int>& keys, OpLatencies& latency) {
+    vector<string> models(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        models[i] = modelOf(keys[i]);
+    }
+    long long found = 0;
+    latency.m_nanos.clear();
+    latency.m_nanos.reserve(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        auto begin = chrono::steady_clock::now();
+        found += db->findCar(models[i], dealerOf(keys[i])) != nullptr;
+        latency.m_nanos.push_back(chrono::duration<float, nano>(chrono::steady_clock::now() - begin).count());
+    }
+    sort(latency.m_nanos.begin(), latency.m_nanos.end());
+    return found;
+}
+
+// runMigration(const BenchConfig& config, int size, prob_t policy, const string& hash, ofstream& results)
+// Loads at least size cars with a small migration budget, until a migration is in flight and its cursor
+// has passed half of the old table; the lookups that follow take no rehash step, so the cursor stays there
+// Times config.m_ops hits on keys whose old home bucket is behind the cursor, which the lookup finds in the
+// current table, and as many ahead of it, still in the old table, then the same keys once the migration is done
+static bool runMigration(const BenchConfig& config, int size, prob_t policy, const string& hash, ofstream& results) {
+    CarDB* db = makeDB(hash, policy);
+    if (!db) {
+        cout << "Unknown hash function " << hash << endl;
+        return false;
+    }
+    db->setMigrationBudget(MIGRATIONBUDGET);
+    int loaded = 0;
+    CarDBStats stats = db->stats();
+    while (loaded < MAXCAPACITY / 2 &&
+           (loaded < size || stats.m_oldCapacity == 0 || stats.m_oldCursor < stats.m_oldCapacity / 2)) {
+        db->insert(Car(modelOf(loaded), 1, dealerOf(loaded), true));
+        loaded++;
+        stats = db->stats();
+    }
+    
+    // Splits the keys by their old home bucket, then samples config.m_ops of each side
+    vector<int> sides[2]; // behind the cursor, ahead of it
+    for (int key = 0; key < loaded; key++) {
+        bool ahead = hashOf(hash, modelOf(key)) % stats.m_oldCapacity >= static_cast<unsigned int>(stats.m_oldCursor);
+        sides[ahead].push_back(key);
+    }
+    for (vector<int>& side : sides) {
+        if (side.empty()) {
+            continue;
+        }
+        Random pick(0, static_cast<int>(side.size()) - 1);
+        vector<int> sample(config.m_ops);
+        for (int& key : sample) {
+            key = side[pick.getRandNum()];
+        }
+        side = std::move(sample);
+    }
+    OpLatencies frozen[2];
+    long long found = timeHits(db, sides[0], frozen[0]) + timeHits(db, sides[1], frozen[1]);
+    
+    // Finishes the migration with the default budget, a few inserts of new keys take the remaining steps
+    db->setMigrationBudget(0);
+    for (int key = loaded; db->stats().m_oldCapacity != 0; key++) {
+        db->insert(Car(modelOf(key), 1, dealerOf(key), true));
+    }
+    OpLatencies settled[2];
+    found += timeHits(db, sides[0], settled[0]) + timeHits(db, sides[1], settled[1]);
+    delete db;
+    
+    char line[256];
+    double cursor = static_cast<double>(stats.m_oldCursor) / stats.m_oldCapacity;
+    snprintf(line, sizeof(line), "%-9d %-11s %-13s %6.2f %9.0f %9.0f %9.0f %9.0f %9.0f %9.0f %9.0f %9.0f", loaded,
+             policyName(policy).c_str(), hash.c_str(), cursor, frozen[0].percentile(0.5), frozen[0].percentile(0.99),
+             frozen[1].percentile(0.5), frozen[1].percentile(0.99), settled[0].percentile(0.5), settled[0].percentile(0.99),
+             settled[1].percentile(0.5), settled[1].percentile(0.99));
+    cout << line << endl;
+    ostringstream json;
+    json << "{\"mode\":\"migration\",\"size\":" << loaded << ",\"policy\":\"" << policyName(policy)
+         << "\",\"hash\":\"" << hash << "\",\"oldCapacity\":" << stats.m_oldCapacity << ",\"capacity\":"
+         << stats.m_capacity << ",\"cursor\":" << cursor << ",\"ops\":" << config.m_ops
+         << ",\"found\":" << found;
+    const char* names[4] = {"behind", "ahead", "settledBehind", "settledAhead"};
+    OpLatencies* latencies[4] = {&frozen[0], &frozen[1], &settled[0], &settled[1]};
+    for (int i = 0; i < 4; i++) {
+        json << ",\"" << names[i] << "\":{\"count\":" << latencies[i]->m_nanos.size()
+             << ",\"p50\":" << latencies[i]->percentile(0.5) << ",\"p90\":" << latencies[i]->percentile(0.9)
+             << ",\"p99\":" << latencies[i]->percentile(0.99) << ",\"max\":" << latencies[i]->percentile(1.0) << "}";
+    }
+    json << "}";
+    results << json.str() << endl;
+    return true;
+}
+
+// runBatch(const BenchConfig& config, int size, prob_t policy, const string& hash, ofstream& results)
+// Loads size cars, then for each batch size looks up config.m_ops loaded keys, a batch at a time, with getCars
+// and with a loop of findCar over the same batch
+// Which of the two goes first alternates between batches, so neither always finds the keys in cache
+static bool runBatch(const BenchConfig& config, int size, prob_t policy, const string& hash, ofstream& results) {
+    CarDB* db = makeDB(hash, policy);
+    if (!db) {
+        cout << "Unknown hash function " << hash << endl;
+        return false;
+    }
+    vector<int> order;
+    Random shuffler(0, size - 1, SHUFFLE);
+    shuffler.setSeed(10);
+    shuffler.getShuffle(order);
+    for (int i = 0; i < size; i++) {
+        db->insert(Car(modelOf(order[i]), 1, dealerOf(order[i]), true));
+    }
+    
+    // The keys and their models are built before the clock starts
+    Random pick(0, size - 1);
+    pick.setSeed(10);
+    vector<int> picked(config.m_ops);
+    vector<string> models(config.m_ops);
+    vector<pair<string_view, int>> keys(config.m_ops);
+    for (long long i = 0; i < config.m_ops; i++) {
+        picked[i] = pick.getRandNum();
+        models[i] = modelOf(picked[i]);
+    }
+    for (long long i = 0; i < config.m_ops; i++) {
+        keys[i] = {models[i], dealerOf(picked[i])};
+    }
+    
+    for (int batch : config.m_batches) {
+        long long batches = config.m_ops / batch;
+        vector<vector<pair<string_view, int>>> slices(batches);
+        for (long long b = 0; b < batches; b++) {
+            slices[b].assign(keys.begin() + b * batch, keys.begin() + (b + 1) * batch);
+        }
+        vector<const Car*> found;
+        long long foundBatch = 0;
+        long long foundLoop = 0;
+        double batchNanos = 0;
+        double loopNanos = 0;
+        auto timeBatch = [&](const vector<pair<string_view, int>>& slice) {
+            auto begin = chrono::steady_clock::now();
+            db->getCars(slice, found);
+            batchNanos += chrono::duration<double, nano>(chrono::steady_clock::now() - begin).count();
+            for (const Car* car : found) {
+                foundBatch += car != nullptr;
+            }
+        };
+        auto timeLoop = [&](const vector<pair<string_view, int>>& slice) {
+            auto begin = chrono::steady_clock::now();
+            for (const pair<string_view, int>& key : slice) {
+                foundLoop += db->findCar(key.first, key.second) != nullptr;
+            }
+            loopNanos += chrono::duration<double, nano>(chrono::steady_clock::now() - begin).count();
+        };
+        for (long long b = 0; b < batches; b++) {
+            if (b % 2 == 0) {
+                timeBatch(slices[b]);
+                timeLoop(slices[b]);
+            } else {
+                timeLoop(slices[b]);
+                timeBatch(slices[b]);
+            }
+        }
+        
+        long long looked = batches * batch;
+        double batchPerKey = looked > 0 ? batchNanos / looked : 0;
+        double loopPerKey = looked > 0 ? loopNanos / looked : 0;
+        double speedup = batchNanos > 0 ? loopNanos / batchNanos : 0;
+        char line[256];
+        snprintf(line, sizeof(line), "%-9d %-11s %-13s %6d %10lld %11.1f %11.1f %8.2f", size, policyName(policy).c_str(),
+                 hash.c_str(), batch, looked, batchPerKey, loopPerKey, speedup);
+        cout << line << endl;
+        results << "{\"mode\":\"batch\",\"size\":" << size << ",\"policy\":\"" << policyName(policy)
+                << "\",\"hash\":\"" << hash << "\",\"batch\":" << batch << ",\"keys\":" << looked
+                << ",\"foundBatch\":" << foundBatch << ",\"foundLoop\":" << foundLoop
+                << ",\"nanosPerKeyBatch\":" << batchPerKey << ",\"nanosPerKeyLoop\":" << loopPerKey
+                << ",\"speedup\":" << speedup << "}" << endl;
+    }
+    delete db;
+    return true;
+}
+
+// splitList(const string& list)
+// Returns the comma separated items of a command line value
+static vector<string> splitList(const string& list) {
+    vector<string> items;
+    stringstream stream(list);
+    string item;
+    while (getline(stream, item, ',')) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+// parseArgs(int argc, char** argv, BenchConfig& config)
+// Reads the command line into config, returns false on an unknown or malformed option
+static bool parseArgs(int argc, char** argv, BenchConfig& config) {
+    for (int i = 1; i + 1 < argc; i += 2) {
+        string option = argv[i];
+        string value = argv[i + 1];
+        if (option == "--mode") {
+            if (value != "mixed" && value != "concurrent" && value != "probes" && value != "migration" &&
+                value != "batch") {
+                return false;
+            }
+            config.m_mode = value;
+        } else if (option == "--sizes") {
+            config.m_sizes.clear();
+            for (const string& size : splitList(value)) {
+                config.m_sizes.push_back(stoi(size));
+            }
+        } else if (option == "--ops") {
+            config.m_ops = stoll(value);
+        } else if (option == "--mix") {
+            vector<string> mix = splitList(value);
+            if (mix.size() != NUMOPS) {
+                return false;
+            }
+            int total = 0;
+            for (int op = 0; op < NUMOPS; op++) {
+                config.m_mix[op] = stoi(mix[op]);
+                total += config.m_mix[op];
+            }
+            if (total != 100) {
+                return false;
+            }
+        } else if (option == "--dist") {
+            if (value == "zipf") config.m_dist = ZIPF;
+            else if (value == "normal") config.m_dist = NORMAL;
+            else if (value == "uniform") config.m_dist = UNIFORMINT;
+            else return false;
+        } else if (option == "--skew") {
+            config.m_skew = stod(value);
+        } else if (option == "--policies") {
+            config.m_policies.clear();
+            for (const string& name : splitList(value)) {
+                if (name == "NONE") config.m_policies.push_back(NONE);
+                else if (name == "QUADRATIC") config.m_policies.push_back(QUADRATIC);
+                else if (name == "DOUBLEHASH") config.m_policies.push_back(DOUBLEHASH);
+                else if (name == "GROUPED") config.m_policies.push_back(GROUPED);
+                else if (name == "ROBINHOOD") config.m_policies.push_back(ROBINHOOD);
+                else return false;
+            }
+        } else if (option == "--hashes") {
+            config.m_hashes = splitList(value);
+        } else if (option == "--threads") {
+            config.m_threads.clear();
+            for (const string& threads : splitList(value)) {
+                if (stoi(threads) < 1) {
+                    return false;
+                }
+                config.m_threads.push_back(stoi(threads));
+            }
+        } else if (option == "--batches") {
+            config.m_batches.clear();
+            for (const string& batch : splitList(value)) {
+                if (stoi(batch) < 1) {
+                    return false;
+                }
+                config.m_batches.push_back(stoi(batch));
+            }
+        } else if (option == "--shards") {
+            config.m_shards = stoi(value);
+        } else if (option == "--load") {
+            config.m_load = stod(value);
+            if (config.m_load < 0 || config.m_load >= 1) {
+                return false;
+            }
+        } else if (option == "--output") {
+            config.m_output = value;
+        } else {
+            return false;
+        }
+    }
+    return argc % 2 == 1;
+}
+
+int main(int argc, char** argv) {
+    BenchConfig config;
+    if (!parseArgs(argc, argv, config)) {
+        cout << "Usage: bench [--mode mixed|concurrent|probes|migration|batch] [--sizes 1000,100000,1000000] [--ops 200000]" << endl
+             << "             [--mix insert,getCar,update,remove] [--dist uniform|normal|zipf] [--skew 0.99] [--load 0.45]" << endl
+             << "             [--policies QUADRATIC,DOUBLEHASH,GROUPED,ROBINHOOD] [--hashes hashCode,hashCodeView,wyHash]" << endl
+             << "             [--threads 1,2,4,8,16] [--shards 16] [--batches 8,16,32,64,128,256,512,1024] [--output bench_output.txt]" << endl;
+        return 1;
+    }
+    ofstream results(config.m_output, ios::app);
+    if (!results) {
+        cout << "Cannot open " << config.m_output << endl;
+        return 1;
+    }
+
+    if (config.m_mode == "batch") {
+        cout << "size      policy      hash           batch       keys getCars ns/key loop ns/key  speedup" << endl;
+        for (int size : config.m_sizes) {
+            for (prob_t policy : config.m_policies) {
+                for (const string& hash : config.m_hashes) {
+                    if (!runBatch(config, size, policy, hash, results)) {
+                        return 1;
+                    }
+                }
+            }
+        }
+        return 0;
+    }
+    if (config.m_mode == "migration") {
+        cout << "size      policy      hash          cursor  behind50  behind99   ahead50   ahead99"
+             << "  settled behind50 behind99   ahead50   ahead99 (ns)" << endl;
+        for (int size : config.m_sizes) {
+            for (prob_t policy : config.m_policies) {
+                for (const string& hash : config.m_hashes) {
+                    if (!runMigration(config, size, policy, hash, results)) {
+                        return 1;
+                    }
+                }
+            }
+        }
+        return 0;
+    }
+    if (config.m_mode == "probes") {
+        if (!STATSENABLED) {
+            cout << "Built without CARDB_STATS, the probes are not counted and only the time per miss is reported" << endl;
+        }
+        cout << "size      policy      hash            load   ns/miss probes/miss    ns/probe buckets/probe" << endl;
+        for (int size : config.m_sizes) {
+            for (prob_t policy : config.m_policies) {
+                for (const string& hash : config.m_hashes) {
+                    if (!runProbes(config, size, policy, hash, results)) {
+                        return 1;
+                    }
+                }
+            }
+        }
+        return 0;
+    }
+    cout << "Keys: " << distName(config.m_dist) << ", mix (insert/getCar/update/remove): " << config.m_mix[0] << "/"
+         << config.m_mix[1] << "/" << config.m_mix[2] << "/" << config.m_mix[3] << ", " << config.m_ops << " operations" << endl;
+    if (config.m_mode == "concurrent") {
+        cout << "Shards: " << config.m_shards << ", cores: " << thread::hardware_concurrency() << endl;
+        cout << "size      policy      hash          threads        ops/s speedup"
+             << "   ins p50   ins p99   get p50   get p99   upd p50   upd p99   rem p50   rem p99 (ns)" << endl;
+        for (int size : config.m_sizes) {
+            for (prob_t policy : config.m_policies) {
+                for (const string& hash : config.m_hashes) {
+                    double baseline = 0;
+                    for (int threads : config.m_threads) {
+                        if (!runConcurrent(config, size, policy, hash, threads, baseline, results)) {
+                            return 1;
+                        }
+                    }
+                }
+            }
+        }
+        return 0;
+    }
+    cout << "size      policy      hash            load ops/s  mixed ops/s  bytes/car"
+         << "   ins p50   ins p99   get p50   get p99   upd p50   upd p99   rem p50   rem p99 (ns)" << endl;
+    for (int size : config.m_sizes) {
+        for (prob_t policy : config.m_policies) {
+            for (const string& hash : config.m_hashes) {
+                if (!runOne(config, size, policy, hash, results)) {
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
@@ -11,17 +11,174 @@
  ************************************************************************/
 
 #include "dealer.h"
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <cerrno>
+#include <fstream>
+#include <chrono>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-// CarDB(int size, hash_fn hash, prob_t probing = DEFPOLCY)
+// Primes roughly doubling past MAXPRIME, used once the table outgrows the prime-by-prime search
+static const int PRIMELADDER[] = {
+    196613, 393241, 786433, 1572869, 3145739, 6291469, 12582917, 25165843,
+    50331653, 100663319, 201326611, 402653189, 805306457, MAXCAPACITY
+};
+
+// Kinds of change recorded in the write-ahead log
+const int LOGINSERT = 1; // insert, replayed as an insert even when the key is already stored
+const int LOGREMOVE = 2; // remove of one car, which is picked among duplicates by its quantity
+const int LOGUPDATE = 3; // new quantity of one car, picked among duplicates by its previous quantity
+
+// fastModMagic(int capacity)
+// Returns the constant that lets fastMod reduce modulo the capacity without a division
+static inline uint64_t fastModMagic(int capacity) {
+    return UINT64_MAX / static_cast<uint32_t>(capacity) + 1;
+}
+
+// fastMod(unsigned int hash, int capacity, uint64_t magic)
+// Returns hash % capacity with two multiplies (Lemire's fastmod), exact for any 32-bit hash and capacity
+static inline unsigned int fastMod(unsigned int hash, int capacity, uint64_t magic) {
+    uint64_t fraction = magic * hash;
+    return static_cast<unsigned int>((static_cast<__uint128_t>(fraction) * static_cast<uint32_t>(capacity)) >> 64);
+}
+
+// wyMix(uint64_t a, uint64_t b)
+// Returns the 128-bit product of a and b with its halves folded together
+static inline uint64_t wyMix(uint64_t a, uint64_t b) {
+    __uint128_t product = static_cast<__uint128_t>(a) * b;
+    return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+}
+
+// wyRead(const char* bytes, size_t length)
+// Returns up to 8 bytes as an integer, read without alignment
+static inline uint64_t wyRead(const char* bytes, size_t length) {
+    uint64_t value = 0;
+    memcpy(&value, bytes, length);
+    return value;
+}
+
+// wyHash(string_view model)
+// Hashes the model 16 bytes at a time with wyhash's multiply-and-fold mixing
+// Models of up to 16 bytes, the usual case, take two overlapping reads and two multiplies
+// The 64-bit result is folded to 32 bits so both the home bucket and the fingerprint get mixed bits
+unsigned int wyHash(string_view model) {
+    const uint64_t secret[2] = {0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL};
+    const char* bytes = model.data();
+    size_t length = model.size();
+    uint64_t seed = wyMix(secret[0], secret[1]);
+    uint64_t a = 0;
+    uint64_t b = 0;
+    
+    if (length <= 16) {
+        if (length >= 4) {
+            size_t middle = (length >> 3) << 2;
+            a = (wyRead(bytes, 4) << 32) | wyRead(bytes + middle, 4);
+            b = (wyRead(bytes + length - 4, 4) << 32) | wyRead(bytes + length - 4 - middle, 4);
+        } else if (length > 0) {
+            a = (uint64_t(static_cast<unsigned char>(bytes[0])) << 16) | (uint64_t(static_cast<unsigned char>(bytes[length >> 1])) << 8) |
+                static_cast<unsigned char>(bytes[length - 1]);
+        }
+    } else {
+        size_t rest = length;
+        while (rest > 16) {
+            seed = wyMix(wyRead(bytes, 8) ^ secret[1], wyRead(bytes + 8, 8) ^ seed);
+            bytes += 16;
+            rest -= 16;
+        }
+        a = wyRead(bytes + rest - 16, 8);
+        b = wyRead(bytes + rest - 8, 8);
+    }
+    __uint128_t product = static_cast<__uint128_t>(a ^ secret[1]) * (b ^ seed);
+    uint64_t hash = wyMix(static_cast<uint64_t>(product) ^ secret[0] ^ length, static_cast<uint64_t>(product >> 64) ^ secret[1]);
+    return static_cast<unsigned int>(hash ^ (hash >> 32));
+}
+
+// groupMatch(const unsigned char* group, unsigned char tag)
+// Returns a bit mask of the GROUPWIDTH control bytes from group that equal tag
+static inline unsigned int groupMatch(const unsigned char* group, unsigned char tag) {
+#ifdef __SSE2__
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(static_cast<char>(tag))));
+#else
+    unsigned int mask = 0;
+    for (int k = 0; k < GROUPWIDTH; k++) {
+        if (group[k] == tag) mask |= 1u << k;
+    }
+    return mask;
+#endif
+}
+
+// groupMatchFree(const unsigned char* group)
+// Returns a bit mask of the GROUPWIDTH control bytes from group that are empty or deleted
+static inline unsigned int groupMatchFree(const unsigned char* group) {
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(group)));
+#else
+    unsigned int mask = 0;
+    for (int k = 0; k < GROUPWIDTH; k++) {
+        if (group[k] & CTRLEMPTY) mask |= 1u << k;
+    }
+    return mask;
+#endif
+}
+
+// filterKey(unsigned int hash, int dealer)
+// Mixes the model hash with the dealer id into the 64 bits a Bloom filter draws its positions from
+static inline uint64_t filterKey(unsigned int hash, int dealer) {
+    return wyMix(hash ^ 0xa0761d6478bd642full, static_cast<uint64_t>(dealer) ^ 0xe7037ed1a0b428dbull);
+}
+
+// filterWords(int capacity)
+// Returns the 64-bit words of the Bloom filter of a table, about one byte per bucket
+static inline int filterWords(int capacity) {
+    return capacity / 8 + 1;
+}
+
+// filterBits(uint64_t key)
+// Returns the four bits a key sets within its word, the filter is blocked so a key costs a single cache line
+static inline uint64_t filterBits(uint64_t key) {
+    return (1ull << (key & 63)) | (1ull << ((key >> 6) & 63)) | (1ull << ((key >> 12) & 63)) | (1ull << ((key >> 18) & 63));
+}
+
+// filterAdd(unsigned long long* filter, int capacity, uint64_t key)
+// Adds a key to the Bloom filter of a table
+static inline void filterAdd(unsigned long long* filter, int capacity, uint64_t key) {
+    filter[((key >> 32) * filterWords(capacity)) >> 32] |= filterBits(key);
+}
+
+// filterHas(const unsigned long long* filter, int capacity, uint64_t key)
+// Returns false if the key was never added to the filter, true if it may have been
+static inline bool filterHas(const unsigned long long* filter, int capacity, uint64_t key) {
+    uint64_t bits = filterBits(key);
+    return (filter[((key >> 32) * filterWords(capacity)) >> 32] & bits) == bits;
+}
+
+// countStat(long long& counter, long long amount = 1)
+// Adds to a counter of CarDB::stats(), compiled out without CARDB_STATS
+static inline void countStat(long long& counter, long long amount = 1) {
+    if constexpr (STATSENABLED) {
+        counter += amount;
+    }
+}
+
+// CarDB(int size, hash_fn hash, prob_t probing = DEFPOLCY, TableAllocator allocator)
 // The default constructor with the required initializations
-CarDB::CarDB(int size, hash_fn hash, prob_t probing = DEFPOLCY) {
+CarDB::CarDB(int size, hash_fn hash, prob_t probing = DEFPOLCY, TableAllocator allocator) {
     
     // Ensure the size is within the range and is a prime number
     if (size < MINPRIME) {
         size = MINPRIME;
         
-    } else if (size > MAXPRIME) {
-        size = MAXPRIME;
+    } else if (size > MAXCAPACITY) {
+        size = MAXCAPACITY;
         
     } else if (!isPrime(size)) {
         size = findNextPrime(size);
@@ -29,338 +186,2701 @@ CarDB::CarDB(int size, hash_fn hash, prob_t probing = DEFPOLCY) {
     
     // Initialize member variables
     m_hash = hash;
+    m_viewHash = nullptr;
     m_currProbing = probing;
-    m_currentTable = new Car[size];
+    m_allocator = allocator.m_allocate && allocator.m_release ? allocator : TableAllocator();
+    m_currentTable = newTable(size);
+    m_currentCtrl = newCtrl(size);
+    m_currentTag = 0;
     m_currentCap = size;
+    m_currentMagic = fastModMagic(size);
+    m_currentDist = probing == ROBINHOOD ? new unsigned int[size] : nullptr;
+    m_currentFilter = nullptr;
+    m_currentKeys = nullptr;
     m_currentSize = 0;
     m_currNumDeleted = 0;
     
     // No old table at the start
     m_oldTable = nullptr;
+    m_oldCtrl = nullptr;
     m_oldCap = 0;
+    m_oldMagic = 0;
     m_oldSize = 0;
     m_oldNumDeleted = 0;
+    m_oldProbing = probing;
+    m_oldFilter = nullptr;
+    m_oldKeys = nullptr;
+    m_oldCursor = 0;
+    m_migrateBudget = 0;
+    m_deferFree = false;
+    m_useFilter = false;
+    m_useModelTotals = false;
+    m_backgroundMigration = false;
+    m_logFd = -1;
+    m_logGroup = 1;
+    m_logPending = 0;
+    m_logFlushMillis = 0;
+    m_logSequence = 0;
+    m_logFailed = false;
+    m_stopFlusher = false;
+    m_traceFd = -1;
+    m_traceLast = 0;
+    m_traceInCall = false;
     
     // Initial policy setup
     m_newPolicy = probing;
 }
 
+// CarDB(int size, hash_view_fn hash, prob_t probing = DEFPOLCY)
+// The constructor for a hash function that takes a string_view, lookups then never copy the model
+CarDB::CarDB(int size, hash_view_fn hash, prob_t probing = DEFPOLCY, TableAllocator allocator) : CarDB(size, static_cast<hash_fn>(nullptr), probing, allocator) {
+    m_viewHash = hash;
+}
+
 // ~CarDB()
-// The destructor deallocates the memory
+// The destructor deallocates the memory, syncing and closing the log and the trace first
 CarDB::~CarDB() {
-    delete[] m_currentTable;
-    delete[] m_oldTable;
+    stopFlusher();
+    if (m_logFd != -1) {
+        syncLog();
+        close(m_logFd);
+    }
+    stopTrace();
+    freeTable(m_currentTable, m_currentCtrl, m_currentCap);
+    freeTable(m_oldTable, m_oldCtrl, m_oldCap);
+    delete[] m_currentDist;
+    delete[] m_currentFilter;
+    delete[] m_oldFilter;
+    delete[] m_currentKeys;
+    delete[] m_oldKeys;
+    for (auto& retired : m_retired) {
+        freeTable(retired.m_table, retired.m_ctrl, retired.m_capacity);
+        delete[] retired.m_keys;
+    }
+}
+
+// insert(const Car& car)
+// Inserts a copy of an object into the current hash table.
+bool CarDB::insert(const Car& car) {
+    return insert(Car(car));
+}
+
+// emplace(string model, int quantity, int dealer)
+// Builds the object from its fields and moves it into the current hash table
+bool CarDB::emplace(string model, int quantity, int dealer) {
+    return insert(Car(std::move(model), quantity, dealer));
 }
 
-// insert(Car car)
-// Inserts an object into the current hash table.
-bool CarDB::insert(Car car) {
+// insert(Car&& car)
+// Inserts an object into the current hash table, moving it into the bucket.
+bool CarDB::insert(Car&& car) {
+    if (m_traceFd != -1 && traceCall(TRACEINSERT, car.m_model, car.m_dealer, car.m_quantity, car.m_used)) {
+        bool inserted = insert(std::move(car));
+        traceResult(inserted);
+        return inserted;
+    }
     
-    // Check if car's ID is within valid range
-    if (car.getDealer() < MINID || car.getDealer() > MAXID) {
+    // Check if car's ID is within valid range, and that its insert can be logged
+    if (car.m_dealer < MINID || car.m_dealer > MAXID || m_logFailed) {
         return false;
     }
     
     // Incremental rehash if old table exists
-    if (m_oldTable) {
+    stepMigration();
+
+    // Insert car into the first spot that is empty or marked deleted
+    // Return false when table is full
+    return finishInsert(placeCar(std::move(car), hashKey(car.m_model)));
+}
+
+// finishInsert(int index)
+// Helper function of insert and upsert that indexes and logs the car just placed in the bucket
+// Returns false if no bucket was found for it, or if its insert could not be logged
+bool CarDB::finishInsert(int index) {
+    if (index == -1) {
+        countStat(m_stats.m_insertFailures);
+        return false;
+    }
+    countStat(m_stats.m_inserts);
+    indexAdd(index);
+    const Car& placed = m_currentTable[index];
+    bool logged = logChange(LOGINSERT, placed.m_model, placed.m_dealer, placed.m_quantity, 0);
+    
+    // If the lambda exceeds, perform a rehash
+    if (lambda() > maxLambda(m_currProbing)) {
         rehash();
     }
+    
+    return logged;
+}
 
-    // Calculate the initial hash index for the car model
-    unsigned int index = m_hash(car.getModel()) % m_currentCap;
+// upsert(Car car, int* previous)
+// Inserts the car, or sets the quantity of the stored car with its model and dealer id
+// The lookup and the search for a free bucket share one probe pass over the current table
+// Returns false if the dealer id is invalid, the table is full or the change could not be logged,
+// otherwise sets previous, when given, to the previous quantity or 0 for a new car
+bool CarDB::upsert(Car car, int* previous) {
+    if (m_traceFd != -1 && traceCall(TRACEUPSERT, car.m_model, car.m_dealer, car.m_quantity, car.m_used)) {
+        int traced = 0;
+        bool done = upsert(std::move(car), &traced);
+        traceResult(done, traced);
+        if (previous) *previous = traced;
+        return done;
+    }
+    if (car.m_dealer < MINID || car.m_dealer > MAXID || m_logFailed) {
+        return false;
+    }
+    stepMigration();
     
-    // Loop through the table to find the car
-    for (int i = 0; i < m_currentCap; i++) {
-        unsigned int probingIndex = index;
-        
-        // Apply the appropriate probing based on the current policy
-        if (m_currProbing == QUADRATIC) {
-            probingIndex = (index + i * i) % m_currentCap;
-            
-        } else if (m_currProbing == DOUBLEHASH) {
-            probingIndex = (index + i * (11 - (m_hash(car.getModel()) % 11))) % m_currentCap;
-        }
+    unsigned int hash = hashKey(car.m_model);
+    int freeSlot;
+    Car* stored = findForUpsert(hash, car.m_model, car.m_dealer, freeSlot);
+    if (stored) {
+        if (previous) *previous = stored->m_quantity;
+        return setQuantity(*stored, car.m_quantity);
+    }
+    if (previous) *previous = 0;
+    return finishInsert(placeCarAt(freeSlot, std::move(car), hash));
+}
 
-        // Insert car if spot is empty or marked deleted
-        if (!m_currentTable[probingIndex].getUsed()) {
-            m_currentTable[probingIndex] = car;
-            m_currentTable[probingIndex].setUsed(true);
-            m_currentSize++;
-            
-            // If the lambda exceeds, perform a rehash
-            if (lambda() > 0.5) {
-                rehash();
-            }
-            
-            return true;
+// adjustQuantity(string_view model, int dealer, int delta, int* previous)
+// Adds delta to the quantity of the car with the model and dealer id, inserting it with a quantity of delta if missing
+// Like upsert it probes once, and builds a car only when it has to insert one
+// The log records the resulting quantity, so replaying it twice does not apply the delta twice
+// Returns false and sets previous like upsert, the quantity may go below zero
+bool CarDB::adjustQuantity(string_view model, int dealer, int delta, int* previous) {
+    if (m_traceFd != -1 && traceCall(TRACEADJUST, model, dealer, delta, false)) {
+        int traced = 0;
+        bool done = adjustQuantity(model, dealer, delta, &traced);
+        traceResult(done, traced);
+        if (previous) *previous = traced;
+        return done;
+    }
+    if (dealer < MINID || dealer > MAXID || m_logFailed) {
+        return false;
+    }
+    stepMigration();
+    
+    unsigned int hash = hashKey(model);
+    int freeSlot;
+    Car* stored = findForUpsert(hash, model, dealer, freeSlot);
+    if (stored) {
+        if (previous) *previous = stored->m_quantity;
+        return setQuantity(*stored, stored->m_quantity + delta);
+    }
+    if (previous) *previous = 0;
+    return finishInsert(placeCarAt(freeSlot, Car(string(model), delta, dealer), hash));
+}
+
+// findForUpsert(unsigned int hash, string_view model, int dealer, int& freeSlot)
+// Returns the stored car with the model and dealer id from either table, nullptr if not found
+// On a miss freeSlot is the bucket of the current table the car goes to, -1 if the table is full
+// Robin Hood tables place a car by displacing others, placeCarAt finds its bucket instead
+Car* CarDB::findForUpsert(unsigned int hash, string_view model, int dealer, int& freeSlot) {
+    freeSlot = -1;
+    bool oldFirst = m_oldTable && oldTableFirst(hash, m_oldCap, m_oldMagic, m_oldCursor);
+    int index = -1;
+    if (oldFirst) {
+        index = findIndex(m_oldTable, m_oldCtrl, m_oldCap, m_oldMagic, m_oldProbing, hash, model, dealer);
+        if (index != -1) {
+            return &m_oldTable[index];
         }
     }
     
-    // Return false when table is full or item already present
-    return false;
+    switch (m_currProbing) {
+        case QUADRATIC:  index = findOrFreeWith<QUADRATIC>(m_currentTable, m_currentCtrl, m_currentCap, m_currentMagic, hash, model, dealer, freeSlot); break;
+        case DOUBLEHASH: index = findOrFreeWith<DOUBLEHASH>(m_currentTable, m_currentCtrl, m_currentCap, m_currentMagic, hash, model, dealer, freeSlot); break;
+        case GROUPED:    index = findOrFreeWith<GROUPED>(m_currentTable, m_currentCtrl, m_currentCap, m_currentMagic, hash, model, dealer, freeSlot); break;
+        case ROBINHOOD:  index = findIndex(m_currentTable, m_currentCtrl, m_currentCap, m_currentMagic, ROBINHOOD, hash, model, dealer); break;
+        default:         index = findOrFreeWith<NONE>(m_currentTable, m_currentCtrl, m_currentCap, m_currentMagic, hash, model, dealer, freeSlot); break;
+    }
+    if (index != -1) {
+        return &m_currentTable[index];
+    }
+    
+    // The car may not have been transferred out of the old table yet
+    if (m_oldTable && !oldFirst) {
+        index = findIndex(m_oldTable, m_oldCtrl, m_oldCap, m_oldMagic, m_oldProbing, hash, model, dealer);
+        if (index != -1) {
+            return &m_oldTable[index];
+        }
+    }
+    return nullptr;
 }
 
-// remove(Car car)
+// setQuantity(Car& car, int quantity)
+// Helper function of updateQuantity, upsert and adjustQuantity that sets the quantity of a stored car,
+// keeping the model totals and the log in step
+// Returns false if the change could not be logged, the quantity is set anyway
+bool CarDB::setQuantity(Car& car, int quantity) {
+    countStat(m_stats.m_updates);
+    if (m_useModelTotals) {
+        m_modelTotals[car.m_model].m_quantity += static_cast<long long>(quantity) - car.m_quantity;
+    }
+    int previous = car.m_quantity;
+    car.m_quantity = quantity;
+    if (BucketKey* key = keyOf(car)) {
+        __atomic_store_n(&key->m_quantity, quantity, __ATOMIC_RELAXED);
+    }
+    return logChange(LOGUPDATE, car.m_model, car.m_dealer, quantity, previous);
+}
+
+// remove(const Car& car)
 // Removes an object into the current hash table
-bool CarDB::remove(Car car) {
-    if (m_oldTable) {
-        rehash();
+bool CarDB::remove(const Car& car) {
+    return remove(car.m_model, car.m_dealer);
+}
+
+// remove(string_view model, int dealer)
+// Removes the object with the model and the dealer id from either table
+// Returns false if no object was removed, or if its removal could not be logged
+bool CarDB::remove(string_view model, int dealer) {
+    if (m_traceFd != -1 && traceCall(TRACEREMOVE, model, dealer, 0, false)) {
+        bool removed = remove(model, dealer);
+        traceResult(removed);
+        return removed;
     }
+    if (m_logFailed) {
+        return false;
+    }
+    stepMigration();
+    
+    // Calculate the hash for the car model once for both tables
+    unsigned int hash = hashKey(model);
+    bool logged = true;
     
     // Lambda function to encapsulate the logic for removing a car from a hash table
     // Allowes the same logic to be used for both the current and old tables
-    auto removeCar =[&](Car* table, int capacity) -> bool {
-        
-        // Calculate the initial hash index for the car model
-        unsigned int index = m_hash(car.getModel()) % m_currentCap;
+    // Each removed car is logged with its quantity, so a replay removes the same one among duplicates
+    auto removeCar =[&](bool old, Car* table, const unsigned char* ctrl, int capacity, unsigned long long magic, prob_t policy) -> bool {
         
-        // Loop through the table to find and remove the car
-        for (int i = 0; i < capacity; i++) {
-            unsigned int probingIndex = index;
-            
-            // Apply the appropriate probing based on the current policy
-            if (m_currProbing == QUADRATIC) {
-                probingIndex = (index + i * i) % m_currentCap;
-                
-            } else if (m_currProbing == DOUBLEHASH) {
-                probingIndex = (index + i * (11 - (m_hash(car.getModel()) % 11))) % m_currentCap;
-            }
-            
-            // Check if the car is at the probing index and mark it as deleted
-            if (table[probingIndex].getUsed() == true && table[probingIndex] == car) {
-                table[probingIndex].setUsed(false);
-                m_currNumDeleted++;
-                
-                // If the deleted ratio exceeds, perform a rehash
-                if (deletedRatio() > 0.8) {
-                    rehash();
-                }
-                return true;
-            }
+        // Find the car by probing the table
+        int index = findIndex(table, ctrl, capacity, magic, policy, hash, model, dealer);
+        if (index == -1) {
+            return false;
         }
-        return false;
+        logged = logChange(LOGREMOVE, model, dealer, 0, table[index].m_quantity) && logged;
+        eraseAt(old, index);
+        return true;
     };
     
-    // Attempt to remove the car from the current table
-    bool removedFromCurrent = removeCar(m_currentTable, m_currentCap);
+    // Attempt to remove the car from the current table, then from the old table
+    bool removedFromCurrent = removeCar(false, m_currentTable, m_currentCtrl, m_currentCap, m_currentMagic, m_currProbing);
+    bool removedFromOld = m_oldTable ? removeCar(true, m_oldTable, m_oldCtrl, m_oldCap, m_oldMagic, m_oldProbing) : false;
+    
+    if (removedFromCurrent || removedFromOld) {
+        countStat(m_stats.m_removes);
+    } else {
+        countStat(m_stats.m_removeMisses);
+    }
     
-    // If there's an old table, attempt to remove the car from it as well
-    bool removedFromOld = m_oldTable ? removeCar(m_oldTable, m_oldCap) : false;
+    // If the deleted ratio exceeds, or the old table has no data left, perform a rehash
+    if ((removedFromCurrent && deletedRatio() > 0.8) || (removedFromOld && m_oldNumDeleted == m_oldSize)) {
+        rehash();
+    }
     
     // Return true if the car was removed from either table
-    return removedFromCurrent || removedFromOld;
+    return (removedFromCurrent || removedFromOld) && logged;
+}
+
+// eraseAt(bool old, int index)
+// Helper function of remove and the log replay that takes the car out of a bucket of either table
+void CarDB::eraseAt(bool old, int index) {
+    indexRemove(old, index);
+    
+    // Robin Hood shifts the rest of the run back instead of leaving a deleted bucket,
+    // except in the old table where a shift could move a car behind the migration cursor
+    if (!old && m_currProbing == ROBINHOOD) {
+        eraseRobinHood(index);
+        return;
+    }
+    Car* table = old ? m_oldTable : m_currentTable;
+    table[index].setUsed(false);
+    setCtrl(old ? m_oldCtrl : m_currentCtrl, old ? m_oldCap : m_currentCap, index, CTRLDELETED);
+    (old ? m_oldNumDeleted : m_currNumDeleted)++;
 }
 
 // rehash()
 // Helper function of Insert and Remove to rehash a hash table
+// Each call visits a bounded number of old buckets, resuming at the migration cursor
 void CarDB::rehash() {
+    chrono::steady_clock::time_point start;
+    if constexpr (STATSENABLED) {
+        start = chrono::steady_clock::now();
+    }
     
     // If no old table exists, prepare a new one
+    bool started = false;
     if (!m_oldTable) {
-        int newCap = findNextPrime((m_currentSize - m_currNumDeleted) * 4);
-        Car* newTable = new Car[newCap]();
-
-        // Swaps the new table with the current one and set it as the old table
-        m_oldTable = m_currentTable;
-        m_oldCap = m_currentCap;
-        m_oldSize = m_currentSize;
-        m_oldNumDeleted = m_currNumDeleted;
+        long long live = m_currentSize - m_currNumDeleted;
+        startMigration(findNextPrime(live * 4 < MAXCAPACITY ? static_cast<int>(live * 4) : MAXCAPACITY));
+        started = true;
+    }
 
-        m_currentTable = newTable;
-        m_currentCap = newCap;
-        m_currentSize = 0; // Adjust for deleted items
-        m_currNumDeleted = 0;
+    // Visit only 25% of the old buckets each time unless a budget was set
+    // A background worker drains a new migration, the caller only helps one that fell behind,
+    // visiting just enough old buckets to finish before the current table runs out of free buckets
+    int budget = m_migrateBudget > 0 ? m_migrateBudget : (m_oldCap + 3) / 4;
+    if (m_backgroundMigration && m_migrateBudget == 0) {
+        long long room = m_currentCap - (static_cast<long long>(m_currentSize) + m_oldSize - m_oldNumDeleted);
+        long long left = m_oldCap - m_oldCursor;
+        budget = static_cast<int>(room > 0 ? min(left, max(256LL, 2 * left / room)) : left);
+    }
+    if (!started || !m_backgroundMigration) {
+        migrate(budget);
+    }
+    
+    // The step goes to the migration in flight, or to the one it just drained
+    if constexpr (STATSENABLED) {
+        long long nanos = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        m_stats.m_rehashSteps++;
+        m_stats.m_rehashNanos += nanos;
+        (m_oldTable ? m_stats.m_migrationNanos : m_stats.m_lastMigrationNanos) += nanos;
     }
+}
 
-    int transferCount = 0;
-    int transferLimit = (m_oldSize - m_oldNumDeleted)/ 4; // Transfer only 25% of old table each time
+// stepMigration()
+// Takes an incremental rehash step while an old table exists
+// A background worker drains the old table on its own, the caller only helps once the worker fell behind:
+// when the cars left in the old table would push the current one past its load factor
+void CarDB::stepMigration() {
+    if (!m_oldTable) {
+        return;
+    }
+    long long pending = static_cast<long long>(m_currentSize) + m_oldSize - m_oldNumDeleted;
+    if (m_backgroundMigration && pending <= maxLambda(m_currProbing) * m_currentCap) {
+        return;
+    }
+    rehash();
+}
 
-    for (int i = 0; i < m_oldCap && transferCount < transferLimit; i++) {
-        if (m_oldTable[i].getUsed()) {
-            Car car = m_oldTable[i];
-            unsigned int index = m_hash(car.getModel()) % m_currentCap;
+// startMigration(int newCap)
+// Helper function of rehash that makes the current table the old one and allocates a new current table
+void CarDB::startMigration(int newCap) {
+    Car* table = newTable(newCap);
+    countStat(m_stats.m_migrations);
 
-            for (int j = 0; j < m_currentCap; j++) {
-                unsigned int probingIndex = index;
+    // Swaps the new table with the current one and set it as the old table
+    m_oldTable = m_currentTable;
+    m_oldCtrl = m_currentCtrl;
+    m_oldCap = m_currentCap;
+    m_oldMagic = m_currentMagic;
+    m_oldSize = m_currentSize;
+    m_oldNumDeleted = m_currNumDeleted;
+    m_oldProbing = m_currProbing;
+    m_oldFilter = m_currentFilter;
+    m_oldKeys = m_currentKeys;
+    m_oldCursor = 0;
 
-                if (m_currProbing == QUADRATIC) {
-                    probingIndex = (index + j * j) % m_currentCap;
+    // The new table adopts any requested change of policy
+    m_currentTable = table;
+    m_currentCtrl = newCtrl(newCap);
+    m_currentTag ^= 0x80000000u; // the buckets already in the index now belong to the old table
+    m_currentCap = newCap;
+    m_currentMagic = fastModMagic(newCap);
+    m_currentFilter = m_useFilter ? new unsigned long long[filterWords(newCap)]() : nullptr;
+    m_currentKeys = m_oldKeys ? new BucketKey[newCap]() : nullptr;
+    
+    // Only inserts and removals use the distances, the old table gets neither
+    delete[] m_currentDist;
+    m_currentDist = m_newPolicy == ROBINHOOD ? new unsigned int[newCap] : nullptr;
+    m_currentSize = 0; // Adjust for deleted items
+    m_currNumDeleted = 0;
+    m_currProbing = m_newPolicy;
+}
 
-                } else if (m_currProbing == DOUBLEHASH) {
-                    probingIndex = (index + j * (11 - (m_hash(car.getModel()) % 11))) % m_currentCap;
-                }
+// migrate(int visitLimit)
+// Helper function of rehash that transfers the data of the next visitLimit old buckets to the current table
+// Returns false when the current table has no free bucket for a car: placeCar leaves the car untouched,
+// so it stays in the old table with the cursor on its bucket and a later step moves it once there is room
+bool CarDB::migrate(int visitLimit) {
+    int end = m_oldCap - m_oldCursor < visitLimit ? m_oldCap : m_oldCursor + visitLimit;
 
-                if (!m_currentTable[probingIndex].getUsed()) {
-                    m_currentTable[probingIndex] = car;
-                    m_currentTable[probingIndex].setUsed(true);
-                    break;
-                }
+    for (int i = m_oldCursor; i < end; i++) {
+        if (!(m_oldCtrl[i] & CTRLEMPTY)) {
+            Car& car = m_oldTable[i];
+            int index = placeCar(std::move(car), hashKey(car.m_model));
+            if (index == -1) {
+                m_oldCursor = i;
+                return false;
             }
+            indexMove(index);
 
+            // A transferred bucket counts as deleted in the old table
             m_oldTable[i].setUsed(false);
-            transferCount++;
+            setCtrl(m_oldCtrl, m_oldCap, i, CTRLDELETED);
+            m_oldNumDeleted++;
         }
     }
+    m_oldCursor = end;
 
     // If the old table is fully transferred, delete it and set to nullptr
-    if (transferCount < transferLimit) {
-        delete[] m_oldTable;
+    if (m_oldCursor == m_oldCap || m_oldNumDeleted == m_oldSize) {
+        countStat(m_stats.m_migrationsDone);
+        if constexpr (STATSENABLED) {
+            m_stats.m_lastMigrationNanos = m_stats.m_migrationNanos;
+            m_stats.m_migrationNanos = 0;
+        }
+        if (m_deferFree) {
+            m_retired.push_back({m_oldTable, m_oldCtrl, m_oldCap, m_oldKeys});
+        } else {
+            freeTable(m_oldTable, m_oldCtrl, m_oldCap);
+            delete[] m_oldKeys;
+        }
+        delete[] m_oldFilter;
         m_oldTable = nullptr;
+        m_oldCtrl = nullptr;
+        m_oldFilter = nullptr;
+        m_oldKeys = nullptr;
     }
+    return true;
 }
 
-// changeProbPolicy(prob_t policy)
-// Changes its probing policy
-void CarDB::changeProbPolicy(prob_t policy) {
-    m_newPolicy = policy;
-    rehash();
+// placeCar(Car&& car, unsigned int hash)
+// Moves the car into the first free bucket of its probe sequence in the current table
+// Returns the bucket it was moved to, -1 when the table is full
+int CarDB::placeCar(Car&& car, unsigned int hash) {
+    if (m_currProbing == ROBINHOOD) {
+        return placeCarAt(-1, std::move(car), hash);
+    }
+    return placeCarAt(findFreeSlot(m_currentCtrl, m_currentCap, m_currentMagic, m_currProbing, hash), std::move(car), hash);
 }
 
-// getCar(string model, int dealer) const
-// Checks for the Car object with the model and the deal id in the hash table
-Car CarDB::getCar(string model, int dealer) const{
-    // Calculate the initial hash index for the given car model
-    unsigned int index = m_hash(model) % m_currentCap;
-    unsigned int originalIndex = index;
-    int i = 0;
-    
-    // Loop through the hash table to find the car
-    while (i < m_currentCap) {
-        const Car& currentCar = m_currentTable[index];
-        
-        // Check if the current car matches the search criteria
-        if (currentCar.getUsed() && currentCar.getModel() == model && currentCar.getDealer() == dealer){
-            return currentCar;
-        }
-        i++;
-        
-        // Calculate the next index based on the collision resolution strategy (probing)
-        if (m_currProbing == QUADRATIC) {
-            index = (originalIndex + i * i) % m_currentCap;
-            
-        } else if (m_currProbing == DOUBLEHASH) {
-            index = (originalIndex + i * (11 - (m_hash(model) % 11))) % m_currentCap;
-            
-        } else {
+// placeCarAt(int index, Car&& car, unsigned int hash)
+// Moves the car into a free bucket of the current table found by the caller and adds it to the table's filter
+// Robin Hood tables pick the bucket themselves, index is ignored
+// Returns the bucket it was moved to, -1 when index is -1
+int CarDB::placeCarAt(int index, Car&& car, unsigned int hash) {
+    if (m_currProbing != ROBINHOOD && index == -1) {
+        return -1;
+    }
+    if (m_currentFilter) {
+        filterAdd(m_currentFilter, m_currentCap, filterKey(hash, car.m_dealer));
+    }
+    if (m_currProbing == ROBINHOOD) {
+        return placeRobinHood(std::move(car), hash);
+    }
+    
+    // Only a bucket that held a car before has one to assign to
+    if (m_currentCtrl[index] == CTRLEMPTY) {
+        new (&m_currentTable[index]) Car(std::move(car));
+    } else {
+        retireModel(m_currentTable[index]);
+        m_currentTable[index] = std::move(car);
+    }
+    m_currentTable[index].setUsed(true);
+    shareKey(index);
+    setCtrl(m_currentCtrl, m_currentCap, index, fingerprint(hash));
+    m_currentSize++;
+    return index;
+}
+
+// placeRobinHood(Car&& car, unsigned int hash)
+// Moves the car into the current table with Robin Hood hashing: walking the run from the home bucket,
+// a car further from its home takes the bucket of a car closer to its own, which then moves on
+// This keeps the distances of a run close to each other, and lookups can stop at the first empty bucket
+// Returns the bucket of the car, -1 when the table is full, in which case neither the car nor the table is changed
+int CarDB::placeRobinHood(Car&& car, unsigned int hash) {
+    
+    // Robin Hood tables have no deleted buckets, so one empty bucket is left for the walk to end in
+    if (m_currentSize + m_currNumDeleted >= m_currentCap) {
+        return -1;
+    }
+    Car moving = std::move(car);
+    moving.setUsed(true); // whichever bucket it takes, the car stored there is in use
+    unsigned char tag = fingerprint(hash);
+    unsigned int distance = 0;
+    unsigned int index = fastMod(hash, m_currentCap, m_currentMagic);
+    int placed = -1;
+    
+    for (int i = 0; i < m_currentCap; i++) {
+        if (m_currentCtrl[index] & CTRLEMPTY) {
+            new (&m_currentTable[index]) Car(std::move(moving));
+            shareKey(index);
+            setCtrl(m_currentCtrl, m_currentCap, index, tag);
+            m_currentDist[index] = distance;
+            m_currentSize++;
             
-            // If the probing strategy is NONE or not recognized, we should not loop indefinitely
-            break;
+            // A displaced car keeps its place in its dealer's list
+            if (placed != -1) {
+                indexMove(index);
+                return placed;
+            }
+            return static_cast<int>(index);
         }
-        
-        // If we have looped back to the original index, the car is not in the table
-        if (index == originalIndex) {
-            break;
+        if (m_currentDist[index] < distance) {
+            unsigned char residentTag = m_currentCtrl[index];
+            swap(moving, m_currentTable[index]);
+            shareKey(index);
+            setCtrl(m_currentCtrl, m_currentCap, index, tag);
+            swap(distance, m_currentDist[index]);
+            tag = residentTag;
+            if (placed == -1) {
+                placed = static_cast<int>(index);
+            } else {
+                indexMove(index);
+            }
         }
+        index++;
+        distance++;
+        if (index == static_cast<unsigned int>(m_currentCap)) index = 0;
     }
-    
-    // If the car was not found, return an empty Car object
-    return EMPTY;
+    return -1;
 }
 
-// lambda() const
-// Returns the load factor of the current hash table
-float CarDB::lambda() const {
-    if (m_currentCap == 0) {
-        return 0.0f;
+// eraseRobinHood(int index)
+// Empties a bucket of the current table by shifting the cars after it one bucket back,
+// up to the first empty bucket or car in its home bucket, so no deleted bucket is left
+void CarDB::eraseRobinHood(int index) {
+    retireModel(m_currentTable[index]);
+    unsigned int hole = index;
+    for (;;) {
+        unsigned int next = hole + 1 == static_cast<unsigned int>(m_currentCap) ? 0 : hole + 1;
+        if ((m_currentCtrl[next] & CTRLEMPTY) || m_currentDist[next] == 0) {
+            break;
+        }
+        m_currentTable[hole] = std::move(m_currentTable[next]);
+        shareKey(hole);
+        setCtrl(m_currentCtrl, m_currentCap, hole, m_currentCtrl[next]);
+        m_currentDist[hole] = m_currentDist[next] - 1;
+        indexMove(hole);
+        hole = next;
     }
+    m_currentTable[hole].~Car();
+    setCtrl(m_currentCtrl, m_currentCap, hole, CTRLEMPTY);
+    m_currentSize--;
+}
 
-    return static_cast<float>(m_currentSize) / m_currentCap;
+// retireModel(Car& car)
+// Helper function of placeCarAt and eraseRobinHood, called before a bucket's model is overwritten or destroyed
+// When the owner frees memory itself, a model stored outside the bucket is moved to m_retiredModels instead,
+// so a lock-free reader that read its address can still compare it until the owner frees it
+void CarDB::retireModel(Car& car) {
+    const char* data = car.m_model.data();
+    const char* bucket = reinterpret_cast<const char*>(&car);
+    if (m_deferFree && (data < bucket || data >= bucket + sizeof(Car))) {
+        m_retiredModels.push_back(std::move(car.m_model));
+    }
 }
 
-// deletedRatio() const
-// Returns the deleted ratio of the current hash table
-float CarDB::deletedRatio() const {
-    if (m_currentSize == 0) {
-        return 0.0f;
+// shareTables()
+// Called by a ConcurrentCarDB for the database of a shard: drained tables and replaced models are left
+// for the shard to free, and every table keeps the reader copies of its keys
+void CarDB::shareTables() {
+    m_deferFree = true;
+    if (!m_currentKeys) {
+        m_currentKeys = new BucketKey[m_currentCap]();
     }
-    
-    return static_cast<float>(m_currNumDeleted) / m_currentSize;
 }
 
-// updateQuantity(Car car, int quantity)
-// Looks for the Car object in the hash table, and updates its quantity
-bool CarDB::updateQuantity(Car car, int quantity) {
-    unsigned int index = m_hash(car.getModel()) % m_currentCap;
-    unsigned int originalIndex = index;
-    int i = 0;
-    
-    // Loops until the car is found or the whole table has been checked
-    while (i < m_currentCap) {
-        if (m_currentTable[index].getUsed() && m_currentTable[index].getModel() == car.getModel() && m_currentTable[index].getDealer() == car.getDealer()) {
-            m_currentTable[index].setQuantity(quantity);
-            return true;
+// shareKey(int index)
+// Copies the key and the quantity of the car just placed in a bucket of the current table into the bucket's
+// reader copy, each field with an atomic store
+// The address of a model kept outside the copy is stored last with release, so a reader that loads it
+// with acquire also sees the bytes it points to
+void CarDB::shareKey(int index) {
+    if (!m_currentKeys) {
+        return;
+    }
+    BucketKey& key = m_currentKeys[index];
+    const Car& car = m_currentTable[index];
+    unsigned int length = car.m_model.size();
+    bool fits = length <= sizeof(key.m_inline);
+    if (fits) {
+        unsigned long long words[3] = {};
+        memcpy(words, car.m_model.data(), length);
+        for (int k = 0; k < 3; k++) {
+            __atomic_store_n(&key.m_inline[k], words[k], __ATOMIC_RELAXED);
         }
+    }
+    __atomic_store_n(&key.m_length, length, __ATOMIC_RELAXED);
+    __atomic_store_n(&key.m_dealer, car.m_dealer, __ATOMIC_RELAXED);
+    __atomic_store_n(&key.m_quantity, car.m_quantity, __ATOMIC_RELAXED);
+    __atomic_store_n(&key.m_model, fits ? nullptr : car.m_model.data(), __ATOMIC_RELEASE);
+}
 
-        // Increment the loop counter and update the index based on the probing strategy
-        i++;
-        if (m_currProbing == QUADRATIC) {
-            index = (originalIndex + i * i) % m_currentCap;
-        } else if (m_currProbing == DOUBLEHASH) {
-            index = (originalIndex + i * (11 - (m_hash(car.getModel()) % 11))) % m_currentCap;
-        }
+// keyOf(const Car& car)
+// Returns the reader copy of the bucket of a stored car, nullptr when the tables keep none
+BucketKey* CarDB::keyOf(const Car& car) {
+    if (!m_currentKeys) {
+        return nullptr;
+    }
+    uintptr_t address = reinterpret_cast<uintptr_t>(&car);
+    uintptr_t current = reinterpret_cast<uintptr_t>(m_currentTable);
+    if (address >= current && address < current + m_currentCap * sizeof(Car)) {
+        return &m_currentKeys[&car - m_currentTable];
+    }
+    return m_oldKeys ? &m_oldKeys[&car - m_oldTable] : nullptr;
+}
 
-        // Loops back to the start if we've gone past the end of the table
-        if (index == originalIndex) {
-            break;
+// indexAdd(int index)
+// Adds the car in a bucket of the current table to its dealer's list and to its model's totals
+void CarDB::indexAdd(int index) {
+    if (m_dealerCars.empty()) {
+        m_dealerCars.resize(MAXID - MINID + 1);
+    }
+    Car& car = m_currentTable[index];
+    if (m_useModelTotals) {
+        ModelTotals& totals = m_modelTotals[car.m_model];
+        totals.m_quantity += car.m_quantity;
+        totals.m_dealers++;
+    }
+    vector<unsigned int>& cars = m_dealerCars[car.m_dealer - MINID];
+    car.m_dealerPos = static_cast<int>(cars.size());
+    cars.push_back(index | m_currentTag);
+}
+
+// indexMove(int index)
+// Points the dealer's list at the bucket of the current table a car of the old table was moved to
+// The car keeps its position in the list
+void CarDB::indexMove(int index) {
+    const Car& car = m_currentTable[index];
+    m_dealerCars[car.m_dealer - MINID][car.m_dealerPos] = index | m_currentTag;
+}
+
+// indexRemove(bool old, int index)
+// Removes the car in a bucket of the old or the current table from its dealer's list and its model's totals
+// The last car of the list takes its place, so the removal does not depend on the length of the list
+void CarDB::indexRemove(bool old, int index) {
+    const Car& car = (old ? m_oldTable : m_currentTable)[index];
+    if (m_useModelTotals) {
+        auto totals = m_modelTotals.find(car.m_model);
+        totals->second.m_quantity -= car.m_quantity;
+        if (--totals->second.m_dealers == 0) {
+            m_modelTotals.erase(totals);
         }
     }
-    
-    // Car not found
-    return false;
+    vector<unsigned int>& cars = m_dealerCars[car.m_dealer - MINID];
+    unsigned int last = cars.back();
+    cars[car.m_dealerPos] = last;
+    cars.pop_back();
+    Car* lastTable = (last & 0x80000000u) == m_currentTag ? m_currentTable : m_oldTable;
+    lastTable[last & 0x7FFFFFFFu].m_dealerPos = car.m_dealerPos;
 }
 
+// forEachCarOfDealer(int dealer, const function<void(const Car&)>& fn) const
+// Calls fn on every car of the dealer in either table, in no particular order
+// Walks the dealer's list only, so the cost is the number of cars found
+int CarDB::forEachCarOfDealer(int dealer, const function<void(const Car&)>& fn) const {
+    if (dealer < MINID || dealer > MAXID || m_dealerCars.empty()) {
+        return 0;
+    }
+    const vector<unsigned int>& cars = m_dealerCars[dealer - MINID];
+    for (unsigned int bucket : cars) {
+        const Car* table = (bucket & 0x80000000u) == m_currentTag ? m_currentTable : m_oldTable;
+        fn(table[bucket & 0x7FFFFFFFu]);
+    }
+    return static_cast<int>(cars.size());
+}
 
-// isPrime(int number)
-// Returns true if the number is a prime number
-bool CarDB::isPrime(int number) {
-    bool result = true;
-    for (int i = 2; i <= number / 2; ++i) {
-        if (number % i == 0) {
-            result = false;
-            break;
+// modelTotals(string_view model) const
+// Returns the total quantity of the model and the number of its cars, without visiting the cars
+// Returns zero totals unless useModelTotals is enabled
+ModelTotals CarDB::modelTotals(string_view model) const {
+    auto totals = m_modelTotals.find(string(model));
+    return totals != m_modelTotals.end() ? totals->second : ModelTotals();
+}
+
+// useModelTotals(bool enabled)
+// Turns the totals of each model on or off, enabling builds them from the cars already stored
+// The totals are off by default: each change then skips the hash map, and no rehash of the map stalls an insert
+void CarDB::useModelTotals(bool enabled) {
+    m_useModelTotals = enabled;
+    unordered_map<string, ModelTotals>().swap(m_modelTotals);
+    if (!enabled) {
+        return;
+    }
+    
+    auto addTable = [&](const Car* table, const unsigned char* ctrl, int capacity) {
+        for (int i = 0; i < capacity; i++) {
+            if (!(ctrl[i] & CTRLEMPTY)) {
+                ModelTotals& totals = m_modelTotals[table[i].m_model];
+                totals.m_quantity += table[i].m_quantity;
+                totals.m_dealers++;
+            }
         }
+    };
+    addTable(m_currentTable, m_currentCtrl, m_currentCap);
+    if (m_oldTable) {
+        addTable(m_oldTable, m_oldCtrl, m_oldCap);
     }
-    return result;
 }
 
-// findNextPrime(int current)
-// Returns the smallest prime number greater than the current
-int CarDB::findNextPrime(int current) {
-    //we always stay within the range [MINPRIME-MAXPRIME]
-    //the smallest prime starts at MINPRIME
-    if (current < MINPRIME) current = MINPRIME-1;
+// insertBatch(vector<Car> cars)
+// Loads many objects at once: finishes any migration, sizes the table once for the whole batch,
+// then places the cars without incremental rehash steps, prefetching the buckets ahead
+// Returns the number of objects inserted, the batch stops at the first car whose insert could not be logged
+int CarDB::insertBatch(vector<Car> cars) {
+    if (m_traceFd != -1 && traceCall(TRACEBATCH, "", 0, static_cast<int>(cars.size()), false)) {
+        traceCars(cars);
+        int inserted = insertBatch(std::move(cars));
+        traceResult(inserted);
+        return inserted;
+    }
+    const size_t lookahead = 8; // cars hashed and prefetched ahead of the one being placed
+    if (m_logFailed) {
+        return 0;
+    }
     
-    for (int i=current; i<MAXPRIME; i++) {
-        for (int j=2; j*j<=i; j++) {
-            if (i % j == 0)
+    // Finish any migration in flight so the batch goes into a single table, nothing is inserted if it cannot finish
+    if (m_oldTable && !migrate(m_oldCap)) {
+        return 0;
+    }
+    
+    // Hash the whole batch up front, skipping cars with an invalid dealer
+    vector<unsigned int> hashes(cars.size());
+    long long batch = 0;
+    for (size_t i = 0; i < cars.size(); i++) {
+        if (cars[i].m_dealer >= MINID && cars[i].m_dealer <= MAXID) {
+            hashes[i] = hashKey(cars[i].m_model);
+            batch++;
+        }
+    }
+    
+    // Grow once to the size a rehash would pick for the final data
+    if (m_currentSize + batch > maxLambda(m_currProbing) * m_currentCap) {
+        long long live = m_currentSize - m_currNumDeleted + batch;
+        startMigration(findNextPrime(live * 4 < MAXCAPACITY ? static_cast<int>(live * 4) : MAXCAPACITY));
+        migrate(m_oldCap);
+    }
+    
+    int inserted = 0;
+    for (size_t i = 0; i < cars.size(); i++) {
+        if (i + lookahead < cars.size()) {
+            unsigned int home = fastMod(hashes[i + lookahead], m_currentCap, m_currentMagic);
+            __builtin_prefetch(m_currentCtrl + home);
+            __builtin_prefetch(m_currentTable + home);
+        }
+        if (cars[i].m_dealer < MINID || cars[i].m_dealer > MAXID) {
+            continue;
+        }
+        int index = placeCar(std::move(cars[i]), hashes[i]);
+        countStat(index != -1 ? m_stats.m_inserts : m_stats.m_insertFailures);
+        if (index != -1) {
+            indexAdd(index);
+            inserted++;
+            const Car& placed = m_currentTable[index];
+            if (!logChange(LOGINSERT, placed.m_model, placed.m_dealer, placed.m_quantity, 0)) {
                 break;
-            else if (j+1 > sqrt(i) && i != current) {
-                return i;
             }
         }
     }
-    //if a user tries to go over MAXPRIME
-    return MAXPRIME;
+    
+    return inserted;
 }
 
-// getCap() const
-// Helper function of testFindOperationWithCollisionReturns that returns the current capacity of the hash table 
-int CarDB::getCap() const {
-    return m_currentCap;
+// setMigrationBudget(int buckets)
+// Sets how many old buckets each incremental rehash step visits, 0 restores the 25% default
+void CarDB::setMigrationBudget(int buckets) {
+    m_migrateBudget = buckets > 0 ? buckets : 0;
 }
 
-void CarDB::dump() const {
-    cout << "Dump for the current table: " << endl;
-    if (m_currentTable != nullptr)
-        for (int i = 0; i < m_currentCap; i++) {
-            cout << "[" << i << "] : " << m_currentTable[i] << endl;
-        }
-    cout << "Dump for the old table: " << endl;
+// useFilter(bool enabled)
+// Turns the Bloom filters of the tables on or off, enabling builds them from the cars already stored
+// Removed cars stay in a filter until their table is replaced by a rehash
+void CarDB::useFilter(bool enabled) {
+    m_useFilter = enabled;
+    delete[] m_currentFilter;
+    delete[] m_oldFilter;
+    m_currentFilter = nullptr;
+    m_oldFilter = nullptr;
+    if (!enabled) {
+        return;
+    }
     
-    if (m_oldTable != nullptr)
-        for (int i = 0; i < m_oldCap; i++) {
-            cout << "[" << i << "] : " << m_oldTable[i] << endl;
+    auto build = [&](const Car* table, const unsigned char* ctrl, int capacity) {
+        unsigned long long* filter = new unsigned long long[filterWords(capacity)]();
+        for (int i = 0; i < capacity; i++) {
+            if (!(ctrl[i] & CTRLEMPTY)) {
+                filterAdd(filter, capacity, filterKey(hashKey(table[i].m_model), table[i].m_dealer));
+            }
         }
+        return filter;
+    };
+    m_currentFilter = build(m_currentTable, m_currentCtrl, m_currentCap);
+    if (m_oldTable) {
+        m_oldFilter = build(m_oldTable, m_oldCtrl, m_oldCap);
+    }
+}
+
+// changeProbPolicy(prob_t policy)
+// Changes its probing policy
+void CarDB::changeProbPolicy(prob_t policy) {
+    if (m_traceFd != -1 && traceCall(TRACEPOLICY, "", 0, policy, false)) {
+        changeProbPolicy(policy);
+        traceResult(0);
+        return;
+    }
+    m_newPolicy = policy;
+    rehash();
+}
+
+// getCar(string model, int dealer) const
+// Checks for the Car object with the model and the deal id in the hash table
+Car CarDB::getCar(string model, int dealer) const{
+    if (m_traceFd != -1 && traceCall(TRACEGETCAR, model, dealer, 0, false)) {
+        Car car = getCar(std::move(model), dealer);
+        traceResult(car.m_quantity, !car.m_model.empty());
+        return car;
+    }
+    const Car* car = findCar(model, dealer);
+    
+    // If the car was not found, return an empty Car object
+    return car ? *car : EMPTY;
+}
+
+// findCar(string_view model, int dealer) const
+// Returns a pointer to the Car object with the model and the dealer id, nullptr if not found
+// Nothing is copied or allocated when the table was built with a hash_view_fn
+const Car* CarDB::findCar(string_view model, int dealer) const {
+    return findInTables(hashKey(model), model, dealer);
+}
+
+// findInTables(unsigned int hash, string_view model, int dealer) const
+// Returns a pointer to the car in either table, nullptr if not found
+// During a migration the table most likely to hold the car is probed first, so a hit costs one probe
+const Car* CarDB::findInTables(unsigned int hash, string_view model, int dealer) const {
+    bool oldFirst = m_oldTable && oldTableFirst(hash, m_oldCap, m_oldMagic, m_oldCursor);
+    const Car* car = nullptr;
+    int probes = 0;
+    int index;
+    
+    // A table whose filter never saw the key cannot hold it
+    uint64_t key = m_currentFilter || m_oldFilter ? filterKey(hash, dealer) : 0;
+    auto mayHold = [&](const unsigned long long* filter, int capacity) {
+        if (filter && !filterHas(filter, capacity, key)) {
+            countStat(m_stats.m_filterSkips);
+            return false;
+        }
+        return true;
+    };
+    if (oldFirst && mayHold(m_oldFilter, m_oldCap)) {
+        index = findIndex(m_oldTable, m_oldCtrl, m_oldCap, m_oldMagic, m_oldProbing, hash, model, dealer, &probes);
+        if (index != -1) {
+            car = &m_oldTable[index];
+        }
+    }
+    if (!car && mayHold(m_currentFilter, m_currentCap)) {
+        index = findIndex(m_currentTable, m_currentCtrl, m_currentCap, m_currentMagic, m_currProbing, hash, model, dealer, &probes);
+        if (index != -1) {
+            car = &m_currentTable[index];
+        }
+    }
+    
+    // The car may not have been transferred out of the old table yet
+    if (!car && m_oldTable && !oldFirst && mayHold(m_oldFilter, m_oldCap)) {
+        index = findIndex(m_oldTable, m_oldCtrl, m_oldCap, m_oldMagic, m_oldProbing, hash, model, dealer, &probes);
+        if (index != -1) {
+            car = &m_oldTable[index];
+        }
+    }
+    if constexpr (STATSENABLED) {
+        recordLookup(probes, car != nullptr);
+    }
+    return car;
+}
+
+// recordLookup(int probes, bool found) const
+// Counts a lookup and its probes in the stats
+void CarDB::recordLookup(int probes, bool found) const {
+    ProbeHistogram& histogram = m_stats.m_probes;
+    m_stats.m_lookups++;
+    m_stats.m_lookupMisses += found ? 0 : 1;
+    histogram.m_counts[probes < PROBEBUCKETS ? (probes > 0 ? probes - 1 : 0) : PROBEBUCKETS - 1]++;
+    histogram.m_probes += probes;
+    histogram.m_max = probes > histogram.m_max ? probes : histogram.m_max;
+}
+
+// oldTableFirst(unsigned int hash, int oldCapacity, unsigned long long oldMagic, int oldCursor)
+// Returns true if a car is more likely in the old table than in the current one during a migration
+// The migration empties the old buckets in order, so a car whose old home bucket the cursor has not reached
+// is almost always still there, only a car pushed along its probe sequence past the cursor is not
+bool CarDB::oldTableFirst(unsigned int hash, int oldCapacity, unsigned long long oldMagic, int oldCursor) {
+    return fastMod(hash, oldCapacity, oldMagic) >= static_cast<unsigned int>(oldCursor);
+}
+
+// getCars(const vector<pair<string_view, int>>& keys, vector<const Car*>& results) const
+// Looks up many (model, dealer) keys at once, results[i] is what findCar returns for keys[i]
+// Keys are hashed and their home buckets prefetched one window ahead of the keys being resolved,
+// so the cache misses of a window overlap instead of following each other
+void CarDB::getCars(const vector<pair<string_view, int>>& keys, vector<const Car*>& results) const {
+    const size_t window = 16; // keys in flight between prefetch and probe
+    size_t count = keys.size();
+    vector<unsigned int> hashes(count);
+    results.assign(count, nullptr);
+    
+    // Hashes a window of keys and prefetches their home buckets
+    auto prefetchWindow = [&](size_t start) {
+        for (size_t i = start; i < count && i < start + window; i++) {
+            hashes[i] = hashKey(keys[i].first);
+            unsigned int home = fastMod(hashes[i], m_currentCap, m_currentMagic);
+            __builtin_prefetch(m_currentCtrl + home);
+            __builtin_prefetch(m_currentTable + home);
+        }
+    };
+    
+    prefetchWindow(0);
+    for (size_t start = 0; start < count; start += window) {
+        prefetchWindow(start + window);
+        for (size_t i = start; i < count && i < start + window; i++) {
+            results[i] = findInTables(hashes[i], keys[i].first, keys[i].second);
+        }
+    }
+}
+
+// lambda() const
+// Returns the load factor of the current hash table
+float CarDB::lambda() const {
+    if (m_currentCap == 0) {
+        return 0.0f;
+    }
+
+    return static_cast<float>(m_currentSize) / m_currentCap;
+}
+
+// deletedRatio() const
+// Returns the deleted ratio of the current hash table
+float CarDB::deletedRatio() const {
+    if (m_currentSize == 0) {
+        return 0.0f;
+    }
+    
+    return static_cast<float>(m_currNumDeleted) / m_currentSize;
+}
+
+// updateQuantity(const Car& car, int quantity)
+// Looks for the Car object in the hash table, and updates its quantity
+bool CarDB::updateQuantity(const Car& car, int quantity) {
+    return updateQuantity(car.m_model, car.m_dealer, quantity);
+}
+
+// updateQuantity(string_view model, int dealer, int quantity)
+// Looks for the Car object by its model and dealer id, and updates its quantity
+bool CarDB::updateQuantity(string_view model, int dealer, int quantity) {
+    if (m_traceFd != -1 && traceCall(TRACEUPDATE, model, dealer, quantity, false)) {
+        bool updated = updateQuantity(model, dealer, quantity);
+        traceResult(updated);
+        return updated;
+    }
+    if (m_logFailed) {
+        return false;
+    }
+    Car* car = const_cast<Car*>(findCar(model, dealer));
+    
+    // Car not found
+    if (car == nullptr) {
+        countStat(m_stats.m_updateMisses);
+        return false;
+    }
+    
+    return setQuantity(*car, quantity);
+}
+
+// ProbeSequence<Policy>
+// Walks the buckets of a probe sequence, the i-th bucket being probeIndex(hash, i, capacity, Policy)
+// Each step is an add and a compare instead of a multiply and a division
+template <prob_t Policy>
+struct ProbeSequence {
+    unsigned int m_index;    // bucket of the current step
+    unsigned int m_step;     // distance to the next bucket
+    unsigned int m_capacity;
+    
+    ProbeSequence(unsigned int hash, int capacity, uint64_t magic) {
+        m_index = fastMod(hash, capacity, magic);
+        m_capacity = capacity;
+        
+        // Quadratic steps are the odd numbers 1, 3, 5, ... since (i + 1)^2 - i^2 = 2i + 1, the first one is -1 + 2
+        m_step = Policy == DOUBLEHASH ? 11 - hash % 11 : capacity - 1;
+    }
+    void next() {
+        if constexpr (Policy == QUADRATIC) {
+            m_step += 2;
+            if (m_step >= m_capacity) m_step -= m_capacity;
+        }
+        m_index += m_step;
+        if (m_index >= m_capacity) m_index -= m_capacity;
+    }
+};
+
+// findIndex(const Car* table, const unsigned char* ctrl, int capacity, unsigned long long magic, prob_t policy,
+//           unsigned int hash, string_view model, int dealer, int* probes = nullptr) const
+// Returns the bucket holding the model and the dealer id in the table, -1 if not found
+// Adds the number of probes to *probes when stats are collected
+// Picks the probe loop compiled for the table's policy once, so the loop itself never checks the policy
+// Robin Hood tables are probed linearly and end each run with an empty bucket, so the grouped scan finds their cars
+int CarDB::findIndex(const Car* table, const unsigned char* ctrl, int capacity, unsigned long long magic, prob_t policy, unsigned int hash, string_view model, int dealer, int* probes) const {
+    int count = 0;
+    int index;
+    switch (policy) {
+        case QUADRATIC:  index = findIndexWith<QUADRATIC>(table, ctrl, capacity, magic, hash, model, dealer, count); break;
+        case DOUBLEHASH: index = findIndexWith<DOUBLEHASH>(table, ctrl, capacity, magic, hash, model, dealer, count); break;
+        case GROUPED:    index = findIndexWith<GROUPED>(table, ctrl, capacity, magic, hash, model, dealer, count); break;
+        case ROBINHOOD:  index = findIndexWith<GROUPED>(table, ctrl, capacity, magic, hash, model, dealer, count); break;
+        default:         index = findIndexWith<NONE>(table, ctrl, capacity, magic, hash, model, dealer, count); break;
+    }
+    if constexpr (STATSENABLED) {
+        if (probes) *probes += count;
+    }
+    return index;
+}
+
+// findIndexWith<Policy>(const Car* table, const unsigned char* ctrl, int capacity, unsigned long long magic,
+//                       unsigned int hash, string_view model, int dealer, int& probes)
+// The probe loop of findIndex for one policy, probes is set to the buckets or groups it probed
+template <prob_t Policy>
+int CarDB::findIndexWith(const Car* table, const unsigned char* ctrl, int capacity, unsigned long long magic, unsigned int hash, string_view model, int dealer, int& probes) {
+    return probeWith<Policy>(ctrl, capacity, magic, hash, probes, [&](unsigned int index) {
+        return table[index].m_dealer == dealer && table[index].m_model == model;
+    });
+}
+
+// probeWith<Policy, Match>(const unsigned char* ctrl, int capacity, unsigned long long magic, unsigned int hash,
+//                          int& probes, Match match)
+// Walks the probe sequence of the hash over the dense control bytes and returns the first bucket
+// whose fingerprint matches and for which match(index) is true, -1 if none
+// Shared by findIndexWith and the lock-free reader of ConcurrentCarDB, which compares the key its own way
+// and sets Shared: a writer may change the control bytes meanwhile, so each one is read with an atomic load
+template <prob_t Policy, bool Shared, class Match>
+int CarDB::probeWith(const unsigned char* ctrl, int capacity, unsigned long long magic, unsigned int hash, int& probes, Match match) {
+    unsigned char tag = fingerprint(hash);
+    
+    // The grouped policy compares a whole group of control bytes at once
+    // and stops at the first group holding a never used bucket
+    if constexpr (Policy == GROUPED) {
+        unsigned int start = fastMod(hash, capacity, magic);
+        unsigned char copy[GROUPWIDTH];
+        for (int i = 0; i < capacity; i += GROUPWIDTH) {
+            const unsigned char* group = ctrl + start;
+            if constexpr (Shared) {
+                for (int k = 0; k < GROUPWIDTH; k++) {
+                    copy[k] = __atomic_load_n(group + k, __ATOMIC_RELAXED);
+                }
+                group = copy;
+            }
+            if constexpr (STATSENABLED) probes++;
+            for (unsigned int matches = groupMatch(group, tag); matches != 0; matches &= matches - 1) {
+                unsigned int index = start + __builtin_ctz(matches);
+                if (index >= static_cast<unsigned int>(capacity)) index -= capacity;
+                if (match(index)) {
+                    return static_cast<int>(index);
+                }
+            }
+            if (groupMatch(group, CTRLEMPTY) != 0) {
+                break;
+            }
+            start += GROUPWIDTH;
+            if (start >= static_cast<unsigned int>(capacity)) start -= capacity;
+        }
+        return -1;
+        
+    } else {
+        // Without a probing strategy only the home bucket is checked,
+        // otherwise the sequence comes back to the home bucket after capacity steps
+        // A never used bucket ends the search: an insert takes the first free bucket of the sequence
+        // and only Robin Hood tables, scanned by groups, empty a bucket again
+        int steps = Policy == NONE ? 1 : capacity;
+        ProbeSequence<Policy> probe(hash, capacity, magic);
+        for (int i = 0; i < steps; i++, probe.next()) {
+            if constexpr (STATSENABLED) probes++;
+            unsigned char byte = Shared ? __atomic_load_n(ctrl + probe.m_index, __ATOMIC_RELAXED) : ctrl[probe.m_index];
+            if (byte == tag) {
+                if (match(probe.m_index)) {
+                    return static_cast<int>(probe.m_index);
+                }
+            } else if (byte == CTRLEMPTY) {
+                break;
+            }
+        }
+        return -1;
+    }
+}
+
+// findOrFreeWith<Policy>(const Car* table, const unsigned char* ctrl, int capacity, unsigned long long magic,
+//                        unsigned int hash, string_view model, int dealer, int& freeSlot)
+// The probe loops of findIndexWith and findFreeSlotWith in a single pass, for upserts
+// Returns the bucket holding the model and the dealer id, or -1 with freeSlot set to the first free bucket
+// of the probe sequence, the one findFreeSlotWith returns, or -1 if there is none
+template <prob_t Policy>
+int CarDB::findOrFreeWith(const Car* table, const unsigned char* ctrl, int capacity, unsigned long long magic, unsigned int hash, string_view model, int dealer, int& freeSlot) {
+    unsigned char tag = fingerprint(hash);
+    freeSlot = -1;
+    
+    if constexpr (Policy == GROUPED) {
+        unsigned int start = fastMod(hash, capacity, magic);
+        for (int i = 0; i < capacity; i += GROUPWIDTH) {
+            const unsigned char* group = ctrl + start;
+            for (unsigned int matches = groupMatch(group, tag); matches != 0; matches &= matches - 1) {
+                unsigned int index = start + __builtin_ctz(matches);
+                if (index >= static_cast<unsigned int>(capacity)) index -= capacity;
+                if (table[index].m_dealer == dealer && table[index].m_model == model) {
+                    return static_cast<int>(index);
+                }
+            }
+            unsigned int free = groupMatchFree(group);
+            if (freeSlot == -1 && free != 0) {
+                unsigned int index = start + __builtin_ctz(free);
+                freeSlot = static_cast<int>(index >= static_cast<unsigned int>(capacity) ? index - capacity : index);
+            }
+            if (groupMatch(group, CTRLEMPTY) != 0) {
+                break;
+            }
+            start += GROUPWIDTH;
+            if (start >= static_cast<unsigned int>(capacity)) start -= capacity;
+        }
+        return -1;
+        
+    } else {
+        int steps = Policy == NONE ? 1 : capacity;
+        ProbeSequence<Policy> probe(hash, capacity, magic);
+        for (int i = 0; i < steps; i++, probe.next()) {
+            unsigned char byte = ctrl[probe.m_index];
+            if (byte == tag) {
+                const Car& currentCar = table[probe.m_index];
+                if (currentCar.m_dealer == dealer && currentCar.m_model == model) {
+                    return static_cast<int>(probe.m_index);
+                }
+            } else if (byte & CTRLEMPTY) {
+                if (freeSlot == -1) freeSlot = static_cast<int>(probe.m_index);
+                if (byte == CTRLEMPTY) break;
+            }
+        }
+        return -1;
+    }
+}
+
+// findFreeSlotWith<Policy>(const unsigned char* ctrl, int capacity, uint64_t magic, unsigned int hash)
+// The probe loop of findFreeSlot for one policy
+template <prob_t Policy>
+static int findFreeSlotWith(const unsigned char* ctrl, int capacity, uint64_t magic, unsigned int hash) {
+    
+    // The grouped policy scans a whole group of control bytes at once
+    if constexpr (Policy == GROUPED) {
+        unsigned int start = fastMod(hash, capacity, magic);
+        for (int i = 0; i < capacity; i += GROUPWIDTH) {
+            unsigned int free = groupMatchFree(ctrl + start);
+            if (free != 0) {
+                unsigned int index = start + __builtin_ctz(free);
+                return static_cast<int>(index >= static_cast<unsigned int>(capacity) ? index - capacity : index);
+            }
+            start += GROUPWIDTH;
+            if (start >= static_cast<unsigned int>(capacity)) start -= capacity;
+        }
+        return -1;
+        
+    } else {
+        int steps = Policy == NONE ? 1 : capacity;
+        ProbeSequence<Policy> probe(hash, capacity, magic);
+        for (int i = 0; i < steps; i++, probe.next()) {
+            if (ctrl[probe.m_index] & CTRLEMPTY) {
+                return static_cast<int>(probe.m_index);
+            }
+        }
+        return -1;
+    }
+}
+
+// findFreeSlot(const unsigned char* ctrl, int capacity, unsigned long long magic, prob_t policy, unsigned int hash) const
+// Returns the first empty or deleted bucket on the probe sequence of the hash, -1 if the table is full
+int CarDB::findFreeSlot(const unsigned char* ctrl, int capacity, unsigned long long magic, prob_t policy, unsigned int hash) const {
+    switch (policy) {
+        case QUADRATIC:  return findFreeSlotWith<QUADRATIC>(ctrl, capacity, magic, hash);
+        case DOUBLEHASH: return findFreeSlotWith<DOUBLEHASH>(ctrl, capacity, magic, hash);
+        case GROUPED:    return findFreeSlotWith<GROUPED>(ctrl, capacity, magic, hash);
+        case ROBINHOOD:  return findFreeSlotWith<GROUPED>(ctrl, capacity, magic, hash);
+        default:         return findFreeSlotWith<NONE>(ctrl, capacity, magic, hash);
+    }
+}
+
+// maxLambda(prob_t policy)
+// Returns the load factor that triggers a rehash under the policy
+// Grouped probing stays short at high load, Robin Hood keeps its runs even up to three quarters,
+// the other policies need half the table free
+float CarDB::maxLambda(prob_t policy) {
+    if (policy == ROBINHOOD) {
+        return 0.75f;
+    }
+    return policy == GROUPED ? 0.875f : 0.5f;
+}
+
+// newTable(int capacity) const
+// Allocates the buckets of a table without constructing them, a car is constructed when a bucket is first used
+// Without an allocator, calloc takes a large table straight from fresh zero pages, so nothing is touched
+// until a bucket is used
+Car* CarDB::newTable(int capacity) const {
+    size_t bytes = static_cast<size_t>(capacity) * sizeof(Car);
+    void* buckets = m_allocator.m_allocate ? m_allocator.m_allocate(m_allocator.m_context, bytes) : calloc(capacity, sizeof(Car));
+    if (!buckets) {
+        throw bad_alloc();
+    }
+    return static_cast<Car*>(buckets);
+}
+
+// freeTable(Car* table, unsigned char* ctrl, int capacity) const
+// Destroys the cars of the buckets that were ever used and releases the table and its control bytes
+// The empty buckets are skipped a group of control bytes at a time
+void CarDB::freeTable(Car* table, unsigned char* ctrl, int capacity) const {
+    if (!table) {
+        return;
+    }
+    for (int start = 0; start < capacity; start += GROUPWIDTH) {
+        unsigned int used = ~groupMatch(ctrl + start, CTRLEMPTY) & ((1u << GROUPWIDTH) - 1);
+        if (capacity - start < GROUPWIDTH) {
+            used &= (1u << (capacity - start)) - 1;
+        }
+        while (used) {
+            table[start + __builtin_ctz(used)].~Car();
+            used &= used - 1;
+        }
+    }
+    if (m_allocator.m_release) {
+        m_allocator.m_release(m_allocator.m_context, table, static_cast<size_t>(capacity) * sizeof(Car));
+    } else {
+        free(table);
+    }
+    delete[] ctrl;
+}
+
+// newCtrl(int capacity)
+// Allocates the control bytes of a table with every bucket empty
+// The first GROUPWIDTH - 1 bytes are cloned past the end so a group read never wraps
+unsigned char* CarDB::newCtrl(int capacity) {
+    unsigned char* ctrl = new unsigned char[capacity + GROUPWIDTH - 1];
+    memset(ctrl, CTRLEMPTY, capacity + GROUPWIDTH - 1);
+    return ctrl;
+}
+
+// setCtrl(unsigned char* ctrl, int capacity, int index, unsigned char value)
+// Sets the control byte of a bucket and its clone past the end of the table
+// The stores are atomic since the lock-free readers of a ConcurrentCarDB load the bytes while they change
+void CarDB::setCtrl(unsigned char* ctrl, int capacity, int index, unsigned char value) {
+    __atomic_store_n(ctrl + index, value, __ATOMIC_RELAXED);
+    if (index < GROUPWIDTH - 1) {
+        __atomic_store_n(ctrl + capacity + index, value, __ATOMIC_RELAXED);
+    }
+}
+
+// fingerprint(unsigned int hash)
+// Returns the control byte of a live car, the top 7 bits of its hash
+unsigned char CarDB::fingerprint(unsigned int hash) {
+    return static_cast<unsigned char>(hash >> 25);
+}
+
+// hashKey(string_view model) const
+// Hashes the model with the view hash when there is one, otherwise with the string hash
+unsigned int CarDB::hashKey(string_view model) const {
+    if (m_viewHash) {
+        return m_viewHash(model);
+    }
+    return m_hash(string(model));
+}
+
+// isPrime(int number)
+// Returns true if the number is a prime number
+bool CarDB::isPrime(int number) {
+    bool result = true;
+    for (int i = 2; i <= number / i; ++i) {
+        if (number % i == 0) {
+            result = false;
+            break;
+        }
+    }
+    return result;
+}
+
+// findNextPrime(int current)
+// Returns the smallest prime number greater than the current
+int CarDB::findNextPrime(int current) {
+    //we search prime by prime within the range [MINPRIME-MAXPRIME]
+    //the smallest prime starts at MINPRIME
+    if (current < MINPRIME) current = MINPRIME-1;
+    
+    //past MAXPRIME the capacity climbs the prime ladder instead
+    if (current >= MAXPRIME) {
+        for (int prime : PRIMELADDER) {
+            if (prime > current)
+                return prime;
+        }
+        return MAXCAPACITY;
+    }
+    
+    for (int i=current; i<MAXPRIME; i++) {
+        for (int j=2; j*j<=i; j++) {
+            if (i % j == 0)
+                break;
+            else if (j+1 > sqrt(i) && i != current) {
+                return i;
+            }
+        }
+    }
+    //MAXPRIME itself is the next prime
+    return MAXPRIME;
+}
+
+// probeIndex(unsigned int hash, int i, int capacity, prob_t policy) const
+// Returns the bucket visited at the i-th step of the probe sequence for a hash
+// The probe loops walk the same sequence incrementally with ProbeSequence
+// Uses 64-bit arithmetic so i * i does not overflow on large tables
+unsigned int CarDB::probeIndex(unsigned int hash, int i, int capacity, prob_t policy) const {
+    unsigned long long index = hash % capacity;
+    
+    if (policy == QUADRATIC) {
+        index += static_cast<unsigned long long>(i) * i;
+        
+    } else if (policy == DOUBLEHASH) {
+        index += static_cast<unsigned long long>(i) * (11 - (hash % 11));
+        
+    } else if (policy == GROUPED || policy == ROBINHOOD) {
+        index += i;
+    }
+    
+    return static_cast<unsigned int>(index % capacity);
+}
+
+// getCap() const
+// Helper function of testFindOperationWithCollisionReturns that returns the current capacity of the hash table 
+int CarDB::getCap() const {
+    return m_currentCap;
+}
+
+void CarDB::dump() const {
+    cout << "Dump for the current table: " << endl;
+    if (m_currentTable != nullptr)
+        for (int i = 0; i < m_currentCap; i++) {
+            cout << "[" << i << "] : ";
+            if (m_currentCtrl[i] != CTRLEMPTY) cout << m_currentTable[i]; // an empty bucket holds no car
+            cout << endl;
+        }
+    cout << "Dump for the old table: " << endl;
+    
+    if (m_oldTable != nullptr)
+        for (int i = 0; i < m_oldCap; i++) {
+            cout << "[" << i << "] : ";
+            if (m_oldCtrl[i] != CTRLEMPTY) cout << m_oldTable[i]; // an empty bucket holds no car
+            cout << endl;
+        }
+}
+
+// stats() const
+// Returns the counters collected so far and the current state of both tables
+CarDBStats CarDB::stats() const {
+    CarDBStats stats = m_stats;
+    stats.m_capacity = m_currentCap;
+    stats.m_live = m_currentSize - m_currNumDeleted;
+    stats.m_deleted = m_currNumDeleted;
+    if (m_oldTable) {
+        stats.m_oldCapacity = m_oldCap;
+        stats.m_oldLive = m_oldSize - m_oldNumDeleted;
+        stats.m_oldDeleted = m_oldNumDeleted;
+        stats.m_oldCursor = m_oldCursor;
+    }
+    return stats;
+}
+
+// dumpStats(ostream& sout = cout) const
+// Writes stats() as a single JSON object on one line, for scripts to parse
+void CarDB::dumpStats(ostream& sout) const {
+    CarDBStats stats = this->stats();
+    sout << "{\"enabled\":" << (STATSENABLED ? "true" : "false")
+         << ",\"lookups\":" << stats.m_lookups << ",\"lookupMisses\":" << stats.m_lookupMisses
+         << ",\"inserts\":" << stats.m_inserts << ",\"insertFailures\":" << stats.m_insertFailures
+         << ",\"removes\":" << stats.m_removes << ",\"removeMisses\":" << stats.m_removeMisses
+         << ",\"updates\":" << stats.m_updates << ",\"updateMisses\":" << stats.m_updateMisses
+         << ",\"filterSkips\":" << stats.m_filterSkips
+         << ",\"probes\":" << stats.m_probes.m_probes << ",\"maxProbes\":" << stats.m_probes.m_max
+         << ",\"probeHistogram\":[";
+    for (int i = 0; i < PROBEBUCKETS; i++) {
+        sout << (i ? "," : "") << stats.m_probes.m_counts[i];
+    }
+    sout << "],\"rehashSteps\":" << stats.m_rehashSteps << ",\"migrations\":" << stats.m_migrations
+         << ",\"migrationsDone\":" << stats.m_migrationsDone << ",\"rehashNanos\":" << stats.m_rehashNanos
+         << ",\"migrationNanos\":" << stats.m_migrationNanos << ",\"lastMigrationNanos\":" << stats.m_lastMigrationNanos
+         << ",\"capacity\":" << stats.m_capacity << ",\"live\":" << stats.m_live << ",\"deleted\":" << stats.m_deleted
+         << ",\"oldCapacity\":" << stats.m_oldCapacity << ",\"oldLive\":" << stats.m_oldLive
+         << ",\"oldDeleted\":" << stats.m_oldDeleted << ",\"oldCursor\":" << stats.m_oldCursor << "}" << endl;
+}
+
+// Readers of a ConcurrentCarDB announce the epoch they started in, one slot per thread
+// A drained table or a replaced model is freed once every announced epoch is newer than its retirement
+const int MAXREADERS = 256;          // threads that can read without a lock at the same time
+const int OPTIMISTICTRIES = 4;       // optimistic attempts before a reader falls back to the lock
+const size_t RECLAIMBATCH = 16;      // retired model lists a shard collects before it looks for ones to free
+struct alignas(64) ReaderSlot {
+    atomic<unsigned long long> m_epoch{0}; // 0 while the thread is not reading
+    atomic<bool> m_taken{false};           // set while a thread holds the slot
+};
+static ReaderSlot g_readers[MAXREADERS];
+static atomic<unsigned long long> g_epoch{1};
+
+// The reader slot of a thread, given back when the thread exits so later threads can take it
+struct ReaderLease {
+    ReaderSlot* m_slot = nullptr;
+    ~ReaderLease() {
+        if (m_slot) {
+            m_slot->m_taken.store(false, memory_order_release);
+        }
+    }
+};
+
+// readerSlot()
+// Returns the reader slot of the calling thread, taking a free one on its first read
+// Returns nullptr while every slot is held by a live thread, a later read tries again
+ReaderSlot* ConcurrentCarDB::readerSlot() {
+    thread_local ReaderLease lease;
+    for (int i = 0; !lease.m_slot && i < MAXREADERS; i++) {
+        bool taken = false;
+        if (!g_readers[i].m_taken.load(memory_order_relaxed) && g_readers[i].m_taken.compare_exchange_strong(taken, true)) {
+            lease.m_slot = &g_readers[i];
+        }
+    }
+    return lease.m_slot;
+}
+
+// ConcurrentCarDB(int shards, int size, hash_fn hash, prob_t probing = DEFPOLCY)
+// Creates the shards, rounding their number up to a power of two and splitting the size between them
+ConcurrentCarDB::ConcurrentCarDB(int shards, int size, hash_fn hash, prob_t probing = DEFPOLCY) {
+    int count = shardCount(shards);
+    m_hash = hash;
+    m_viewHash = nullptr;
+    m_shardMask = count - 1;
+    m_stopWorker = false;
+    for (int i = 0; i < count; i++) {
+        m_shards.push_back(make_unique<Shard>(size / count, hash, probing));
+    }
+}
+
+// ConcurrentCarDB(int shards, int size, hash_view_fn hash, prob_t probing = DEFPOLCY)
+// Creates the shards for a hash function that takes a string_view
+ConcurrentCarDB::ConcurrentCarDB(int shards, int size, hash_view_fn hash, prob_t probing = DEFPOLCY) {
+    int count = shardCount(shards);
+    m_hash = nullptr;
+    m_viewHash = hash;
+    m_shardMask = count - 1;
+    m_stopWorker = false;
+    for (int i = 0; i < count; i++) {
+        m_shards.push_back(make_unique<Shard>(size / count, hash, probing));
+    }
+}
+
+// insert(const Car& car)
+// Inserts an object into the shard owning its model
+bool ConcurrentCarDB::insert(const Car& car) {
+    Shard& shard = shardOf(car.m_model);
+    lock_guard<mutex> lock(shard.m_lock);
+    beginWrite(shard);
+    bool result = shard.m_db.insert(car);
+    endWrite(shard);
+    return result;
+}
+
+// remove(string_view model, int dealer)
+// Removes the object from the shard owning its model
+bool ConcurrentCarDB::remove(string_view model, int dealer) {
+    Shard& shard = shardOf(model);
+    lock_guard<mutex> lock(shard.m_lock);
+    beginWrite(shard);
+    bool result = shard.m_db.remove(model, dealer);
+    endWrite(shard);
+    return result;
+}
+
+// getCar(string_view model, int dealer) const
+// Returns a copy of the object from the shard owning its model, EMPTY if not found
+// Reads without the lock unless writers keep changing the shard during the read
+Car ConcurrentCarDB::getCar(string_view model, int dealer) const {
+    Shard& shard = shardOf(model);
+    ReaderSlot* slot = readerSlot();
+    
+    if (slot) {
+        // Announce the epoch so no table this read can reach is freed under it
+        slot->m_epoch.store(g_epoch.load());
+        atomic_thread_fence(memory_order_seq_cst);
+        
+        unsigned int hash = shard.m_db.hashKey(model);
+        for (int attempt = 0; attempt < OPTIMISTICTRIES; attempt++) {
+            unsigned int version = shard.m_version.load(memory_order_acquire);
+            int quantity = 0;
+            bool found = false;
+            if (!(version & 1) && tryRead(shard, version, hash, model, dealer, quantity, found)) {
+                slot->m_epoch.store(0, memory_order_release);
+                return found ? Car(string(model), quantity, dealer, true) : EMPTY;
+            }
+        }
+        slot->m_epoch.store(0, memory_order_release);
+    }
+    
+    // Too many writers in a row, or no reader slot left
+    lock_guard<mutex> lock(shard.m_lock);
+    const Car* car = shard.m_db.findCar(model, dealer);
+    return car ? *car : EMPTY;
+}
+
+// tryRead(const Shard& shard, unsigned int version, unsigned int hash, string_view model, int dealer,
+//         int& quantity, bool& found) const
+// Looks the car up without the lock, returns false if a writer changed the shard since version
+// Only the quantity is copied out, the model of a hit is the one searched for
+bool ConcurrentCarDB::tryRead(const Shard& shard, unsigned int version, unsigned int hash, string_view model, int dealer, int& quantity, bool& found) const {
+    // Take a consistent view of the tables before probing them
+    // The arrays are loaded with acquire, so their contents from before they were published are visible
+    const unsigned char* ctrl = shard.m_current.m_ctrl.load(memory_order_acquire);
+    const BucketKey* keys = shard.m_current.m_keys.load(memory_order_acquire);
+    int capacity = shard.m_current.m_capacity.load(memory_order_relaxed);
+    unsigned long long magic = shard.m_current.m_magic.load(memory_order_relaxed);
+    prob_t policy = shard.m_current.m_policy.load(memory_order_relaxed);
+    const unsigned char* oldCtrl = shard.m_old.m_ctrl.load(memory_order_acquire);
+    const BucketKey* oldKeys = shard.m_old.m_keys.load(memory_order_acquire);
+    int oldCapacity = shard.m_old.m_capacity.load(memory_order_relaxed);
+    unsigned long long oldMagic = shard.m_old.m_magic.load(memory_order_relaxed);
+    prob_t oldPolicy = shard.m_old.m_policy.load(memory_order_relaxed);
+    int oldCursor = shard.m_oldCursor.load(memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    if (shard.m_version.load(memory_order_relaxed) != version) {
+        return false;
+    }
+    
+    // Probes the table most likely to hold the car first, the other one only on a miss
+    bool oldFirst = oldCtrl && CarDB::oldTableFirst(hash, oldCapacity, oldMagic, oldCursor);
+    int index = -1;
+    if (oldFirst) {
+        index = findUnlocked(shard, version, oldCtrl, oldKeys, oldCapacity, oldMagic, oldPolicy, hash, model, dealer);
+    }
+    if (index != -1) {
+        keys = oldKeys;
+    } else {
+        index = findUnlocked(shard, version, ctrl, keys, capacity, magic, policy, hash, model, dealer);
+    }
+    if (index == -1 && oldCtrl && !oldFirst) {
+        keys = oldKeys;
+        index = findUnlocked(shard, version, oldCtrl, oldKeys, oldCapacity, oldMagic, oldPolicy, hash, model, dealer);
+    }
+    found = index != -1;
+    if (found) {
+        quantity = __atomic_load_n(&keys[index].m_quantity, __ATOMIC_RELAXED);
+    }
+    
+    // The result only counts if no writer started meanwhile
+    atomic_thread_fence(memory_order_acquire);
+    return shard.m_version.load(memory_order_relaxed) == version;
+}
+
+// findUnlocked(const Shard& shard, unsigned int version, const unsigned char* ctrl, const BucketKey* keys, int capacity,
+//              unsigned long long magic, prob_t policy, unsigned int hash, string_view model, int dealer)
+// The probe of tryRead, which reads only the control bytes and the reader copies of the keys, never a Car
+// An inline model is compared from a copy of its words; for a model read through its address, the address and
+// the length are checked against the version first: if no writer started they belong together,
+// and the shard only frees that memory once this reader's epoch ends
+// Returns the bucket found, or any bucket once the version changed since tryRead then fails the attempt
+int ConcurrentCarDB::findUnlocked(const Shard& shard, unsigned int version, const unsigned char* ctrl, const BucketKey* keys, int capacity, unsigned long long magic, prob_t policy, unsigned int hash, string_view model, int dealer) {
+    auto match = [&](unsigned int index) {
+        const BucketKey& key = keys[index];
+        unsigned int length = __atomic_load_n(&key.m_length, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&key.m_dealer, __ATOMIC_RELAXED) != dealer || length != model.size()) {
+            return false;
+        }
+        if (length <= sizeof(key.m_inline)) {
+            unsigned long long words[3];
+            for (unsigned int k = 0; k * 8 < length; k++) {
+                words[k] = __atomic_load_n(&key.m_inline[k], __ATOMIC_RELAXED);
+            }
+            return memcmp(words, model.data(), length) == 0;
+        }
+        const char* bytes = __atomic_load_n(&key.m_model, __ATOMIC_ACQUIRE);
+        atomic_thread_fence(memory_order_acquire);
+        if (shard.m_version.load(memory_order_relaxed) != version) {
+            return true;
+        }
+        return bytes && memcmp(bytes, model.data(), length) == 0;
+    };
+    int probes = 0;
+    switch (policy) {
+        case QUADRATIC:  return CarDB::probeWith<QUADRATIC, true>(ctrl, capacity, magic, hash, probes, match);
+        case DOUBLEHASH: return CarDB::probeWith<DOUBLEHASH, true>(ctrl, capacity, magic, hash, probes, match);
+        case GROUPED:    return CarDB::probeWith<GROUPED, true>(ctrl, capacity, magic, hash, probes, match);
+        case ROBINHOOD:  return CarDB::probeWith<GROUPED, true>(ctrl, capacity, magic, hash, probes, match);
+        default:         return CarDB::probeWith<NONE, true>(ctrl, capacity, magic, hash, probes, match);
+    }
+}
+
+// updateQuantity(string_view model, int dealer, int quantity)
+// Updates the quantity of the object in the shard owning its model
+bool ConcurrentCarDB::updateQuantity(string_view model, int dealer, int quantity) {
+    Shard& shard = shardOf(model);
+    lock_guard<mutex> lock(shard.m_lock);
+    beginWrite(shard);
+    bool result = shard.m_db.updateQuantity(model, dealer, quantity);
+    endWrite(shard);
+    return result;
+}
+
+// upsert(Car car, int* previous)
+// Inserts or updates the object in the shard owning its model, returns like CarDB::upsert
+bool ConcurrentCarDB::upsert(Car car, int* previous) {
+    Shard& shard = shardOf(car.m_model);
+    lock_guard<mutex> lock(shard.m_lock);
+    beginWrite(shard);
+    bool done = shard.m_db.upsert(std::move(car), previous);
+    endWrite(shard);
+    return done;
+}
+
+// adjustQuantity(string_view model, int dealer, int delta, int* previous)
+// Adds delta to the quantity in place with the shard locked, so concurrent adjustments never lose one
+// Returns like CarDB::adjustQuantity
+bool ConcurrentCarDB::adjustQuantity(string_view model, int dealer, int delta, int* previous) {
+    Shard& shard = shardOf(model);
+    lock_guard<mutex> lock(shard.m_lock);
+    beginWrite(shard);
+    bool done = shard.m_db.adjustQuantity(model, dealer, delta, previous);
+    endWrite(shard);
+    return done;
+}
+
+// forEachCarOfDealer(int dealer, const function<void(const Car&)>& fn) const
+// Calls fn on the cars of the dealer in each shard, one shard at a time
+int ConcurrentCarDB::forEachCarOfDealer(int dealer, const function<void(const Car&)>& fn) const {
+    int count = 0;
+    for (const auto& shard : m_shards) {
+        lock_guard<mutex> lock(shard->m_lock);
+        count += shard->m_db.forEachCarOfDealer(dealer, fn);
+    }
+    return count;
+}
+
+// modelTotals(string_view model) const
+// Returns the totals of the model from the one shard that holds all of its cars
+ModelTotals ConcurrentCarDB::modelTotals(string_view model) const {
+    const Shard& shard = shardOf(model);
+    lock_guard<mutex> lock(shard.m_lock);
+    return shard.m_db.modelTotals(model);
+}
+
+// useModelTotals(bool enabled)
+// Turns the totals of each model on or off in every shard
+void ConcurrentCarDB::useModelTotals(bool enabled) {
+    for (auto& shard : m_shards) {
+        lock_guard<mutex> lock(shard->m_lock);
+        shard->m_db.useModelTotals(enabled);
+    }
+}
+
+// changeProbPolicy(prob_t policy)
+// Changes the probing policy of every shard, one shard at a time
+void ConcurrentCarDB::changeProbPolicy(prob_t policy) {
+    for (auto& shard : m_shards) {
+        lock_guard<mutex> lock(shard->m_lock);
+        beginWrite(*shard);
+        shard->m_db.changeProbPolicy(policy);
+        endWrite(*shard);
+    }
+}
+
+// ~ConcurrentCarDB()
+// Stops the background migration worker before the shards go away
+ConcurrentCarDB::~ConcurrentCarDB() {
+    stopMigrationWorker();
+}
+
+// startMigrationWorker(int bucketsPerStep = 4096, int intervalMicros = 50)
+// Starts a thread that drains the migrations of the shards at a bounded rate
+// Each step locks one shard like a writer, so readers and writers see the same states as with inline steps
+void ConcurrentCarDB::startMigrationWorker(int bucketsPerStep, int intervalMicros) {
+    stopMigrationWorker();
+    for (auto& shard : m_shards) {
+        lock_guard<mutex> lock(shard->m_lock);
+        shard->m_db.m_backgroundMigration = true;
+    }
+    m_stopWorker = false;
+    m_worker = thread(&ConcurrentCarDB::migrationWorker, this, bucketsPerStep > 0 ? bucketsPerStep : 1, intervalMicros > 0 ? intervalMicros : 0);
+}
+
+// stopMigrationWorker()
+// Stops the background thread, the writers then migrate inline again
+void ConcurrentCarDB::stopMigrationWorker() {
+    if (!m_worker.joinable()) {
+        return;
+    }
+    m_stopWorker = true;
+    m_worker.join();
+    for (auto& shard : m_shards) {
+        lock_guard<mutex> lock(shard->m_lock);
+        shard->m_db.m_backgroundMigration = false;
+    }
+}
+
+// migrationWorker(int bucketsPerStep, int intervalMicros)
+// The loop of the background thread: transfers bucketsPerStep old buckets of every migrating shard,
+// then sleeps intervalMicros, or a millisecond when no shard is migrating
+void ConcurrentCarDB::migrationWorker(int bucketsPerStep, int intervalMicros) {
+    const chrono::milliseconds idle(1);
+    while (!m_stopWorker.load(memory_order_relaxed)) {
+        bool migrating = false;
+        for (auto& shard : m_shards) {
+            lock_guard<mutex> lock(shard->m_lock);
+            if (shard->m_db.m_oldTable) {
+                beginWrite(*shard);
+                shard->m_db.migrate(bucketsPerStep);
+                endWrite(*shard);
+                migrating = migrating || shard->m_db.m_oldTable;
+            }
+        }
+        if (migrating) {
+            this_thread::sleep_for(chrono::microseconds(intervalMicros));
+        } else {
+            this_thread::sleep_for(idle);
+        }
+    }
+}
+
+// numShards() const
+// Returns the number of shards
+int ConcurrentCarDB::numShards() const {
+    return static_cast<int>(m_shards.size());
+}
+
+// shardOf(string_view model) const
+// Returns the shard owning the model
+// The hash is mixed first so the shard does not depend on the bits that pick the bucket
+ConcurrentCarDB::Shard& ConcurrentCarDB::shardOf(string_view model) const {
+    unsigned int hash = m_viewHash ? m_viewHash(model) : m_hash(string(model));
+    return *m_shards[((hash * 2654435761u) >> 16) & m_shardMask];
+}
+
+// beginWrite(Shard& shard)
+// Marks the shard as changing, the shard's lock must be held
+void ConcurrentCarDB::beginWrite(Shard& shard) {
+    shard.m_version.store(shard.m_version.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+// endWrite(Shard& shard)
+// Marks the shard as stable again, then frees the drained tables no reader can still reach
+void ConcurrentCarDB::endWrite(Shard& shard) {
+    publishTables(shard);
+    shard.m_version.store(shard.m_version.load(memory_order_relaxed) + 1, memory_order_release);
+    
+    // Tables drained and models replaced by this write are stamped with a new epoch
+    bool drained = !shard.m_db.m_retired.empty();
+    for (auto& retired : shard.m_db.m_retired) {
+        shard.m_retired.push_back({retired.m_table, retired.m_ctrl, retired.m_capacity, retired.m_keys, g_epoch.fetch_add(1), {}});
+    }
+    shard.m_db.m_retired.clear();
+    if (!shard.m_db.m_retiredModels.empty()) {
+        shard.m_retired.push_back({nullptr, nullptr, 0, nullptr, g_epoch.fetch_add(1), std::move(shard.m_db.m_retiredModels)});
+        shard.m_db.m_retiredModels.clear();
+    }
+    
+    // Models are freed in batches, a table as soon as possible
+    bool holdsTable = any_of(shard.m_retired.begin(), shard.m_retired.end(), [](const Retired& retired) {
+        return retired.m_table != nullptr;
+    });
+    if (!drained && !holdsTable && shard.m_retired.size() < RECLAIMBATCH) {
+        return;
+    }
+    
+    // A table is safe to free once no reader announced an epoch at or before its retirement
+    unsigned long long oldestReader = ~0ULL;
+    for (const ReaderSlot& reader : g_readers) {
+        unsigned long long epoch = reader.m_epoch.load();
+        if (epoch != 0 && epoch < oldestReader) {
+            oldestReader = epoch;
+        }
+    }
+    auto it = shard.m_retired.begin();
+    while (it != shard.m_retired.end()) {
+        if (it->m_epoch < oldestReader) {
+            shard.m_db.freeTable(it->m_table, it->m_ctrl, it->m_capacity);
+            delete[] it->m_keys;
+            it = shard.m_retired.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// publishTables(Shard& shard)
+// Copies what the lock-free readers need of the shard's tables into its views, the shard's lock must be held
+// The arrays are published with release, after everything written to them
+void ConcurrentCarDB::publishTables(Shard& shard) {
+    const CarDB& db = shard.m_db;
+    auto publish = [](TableView& view, const unsigned char* ctrl, const BucketKey* keys, int capacity,
+                      unsigned long long magic, prob_t policy) {
+        view.m_capacity.store(capacity, memory_order_relaxed);
+        view.m_magic.store(magic, memory_order_relaxed);
+        view.m_policy.store(policy, memory_order_relaxed);
+        view.m_keys.store(keys, memory_order_release);
+        view.m_ctrl.store(ctrl, memory_order_release);
+    };
+    publish(shard.m_current, db.m_currentCtrl, db.m_currentKeys, db.m_currentCap, db.m_currentMagic, db.m_currProbing);
+    publish(shard.m_old, db.m_oldCtrl, db.m_oldKeys, db.m_oldCap, db.m_oldMagic, db.m_oldProbing);
+    shard.m_oldCursor.store(db.m_oldCursor, memory_order_relaxed);
+}
+
+// ~Shard()
+// Frees the drained tables still waiting, no reader is left once the database is destroyed
+ConcurrentCarDB::Shard::~Shard() {
+    for (auto& retired : m_retired) {
+        m_db.freeTable(retired.m_table, retired.m_ctrl, retired.m_capacity);
+        delete[] retired.m_keys;
+    }
+}
+
+// shardCount(int shards)
+// Returns the smallest power of two that is at least shards
+int ConcurrentCarDB::shardCount(int shards) {
+    int count = 1;
+    while (count < shards && count < (1 << 16)) {
+        count <<= 1;
+    }
+    return count;
+}
+
+// Snapshot file layout, in native byte order:
+// header | control bytes (capacity + GROUPWIDTH - 1, padded to 8) | records (capacity) | model strings
+// The buckets are laid out for GROUPED probing at a load factor of at most 0.5
+const char SNAPSHOTMAGIC[8] = {'C', 'A', 'R', 'D', 'B', 'S', 'N', 'P'};
+const uint32_t SNAPSHOTVERSION = 2;
+struct SnapshotHeader {
+    char     m_magic[8];
+    uint32_t m_version;
+    uint32_t m_capacity;
+    uint32_t m_count;
+    uint32_t m_hashCheck;      // hash of SNAPSHOTMAGIC, catches opening with another hash function
+    uint64_t m_recordOffset;
+    uint64_t m_stringOffset;
+    uint64_t m_fileBytes;
+    uint64_t m_checksum;       // FNV-1a of everything after the header
+    uint64_t m_logSequence;    // last logged change the snapshot holds, recovery replays only the later ones
+};
+
+// snapshotChecksum(uint64_t checksum, const void* data, size_t length)
+// Continues the 64-bit FNV-1a hash of a byte stream over the bytes
+static uint64_t snapshotChecksum(uint64_t checksum, const void* data, size_t length) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < length; i++) {
+        checksum = (checksum ^ bytes[i]) * 1099511628211ULL;
+    }
+    return checksum;
+}
+const uint64_t CHECKSUMSEED = 14695981039346656037ULL;
+
+// syncPath(const string& path)
+// Flushes a file or a directory to disk, returns false on an I/O error
+static bool syncPath(const string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    bool synced = fsync(fd) == 0;
+    close(fd);
+    return synced;
+}
+
+// saveSnapshot(const string& path) const
+// Writes every live car of both tables to a snapshot file
+// The file is written next to the path and renamed over it, so a crash never leaves half a snapshot
+bool CarDB::saveSnapshot(const string& path) const {
+    
+    // Lays the live cars out in fresh buckets
+    long long live = (m_currentSize - m_currNumDeleted) + (m_oldTable ? m_oldSize - m_oldNumDeleted : 0);
+    int capacity = findNextPrime(live * 2 < MAXCAPACITY ? static_cast<int>(live * 2) : MAXCAPACITY);
+    uint64_t magic = fastModMagic(capacity);
+    vector<unsigned char> ctrl((capacity + GROUPWIDTH - 1 + 7) / 8 * 8, CTRLEMPTY);
+    vector<CarSnapshot::Record> records(capacity, CarSnapshot::Record{0, 0, 0, 0});
+    string strings;
+    
+    auto addTable = [&](const Car* table, const unsigned char* tableCtrl, int tableCap) {
+        for (int i = 0; i < tableCap; i++) {
+            if (tableCtrl[i] & CTRLEMPTY) {
+                continue;
+            }
+            const Car& car = table[i];
+            unsigned int hash = hashKey(car.m_model);
+            int index = findFreeSlot(ctrl.data(), capacity, magic, GROUPED, hash);
+            if (index == -1) {
+                continue;
+            }
+            setCtrl(ctrl.data(), capacity, index, fingerprint(hash));
+            records[index] = {static_cast<unsigned int>(strings.size()), static_cast<unsigned int>(car.m_model.size()),
+                              car.m_quantity, car.m_dealer};
+            strings += car.m_model;
+        }
+    };
+    addTable(m_currentTable, m_currentCtrl, m_currentCap);
+    if (m_oldTable) {
+        addTable(m_oldTable, m_oldCtrl, m_oldCap);
+    }
+    
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.m_magic, SNAPSHOTMAGIC, sizeof(SNAPSHOTMAGIC));
+    header.m_version = SNAPSHOTVERSION;
+    header.m_capacity = capacity;
+    header.m_count = static_cast<uint32_t>(live);
+    header.m_hashCheck = hashKey(string_view(SNAPSHOTMAGIC, sizeof(SNAPSHOTMAGIC)));
+    header.m_logSequence = m_logSequence;
+    header.m_recordOffset = sizeof(header) + ctrl.size();
+    header.m_stringOffset = header.m_recordOffset + records.size() * sizeof(CarSnapshot::Record);
+    header.m_fileBytes = header.m_stringOffset + strings.size();
+    header.m_checksum = snapshotChecksum(CHECKSUMSEED, ctrl.data(), ctrl.size());
+    header.m_checksum = snapshotChecksum(header.m_checksum, records.data(), records.size() * sizeof(CarSnapshot::Record));
+    header.m_checksum = snapshotChecksum(header.m_checksum, strings.data(), strings.size());
+    
+    string tempPath = path + ".tmp";
+    ofstream out(tempPath, ios::binary | ios::trunc);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(ctrl.data()), ctrl.size());
+    out.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(CarSnapshot::Record));
+    out.write(strings.data(), strings.size());
+    out.close();
+    if (!out || !syncPath(tempPath)) {
+        std::remove(tempPath.c_str());
+        return false;
+    }
+    
+    // The rename is only durable once the directory holding the file is synced
+    size_t slash = path.rfind('/');
+    string directory = slash == string::npos ? "." : path.substr(0, slash + 1);
+    return std::rename(tempPath.c_str(), path.c_str()) == 0 && syncPath(directory);
+}
+
+// open(const string& path, hash_fn hash, bool verify)
+// Maps a snapshot file for a hash function that takes a string
+unique_ptr<CarSnapshot> CarSnapshot::open(const string& path, hash_fn hash, bool verify) {
+    return map(path, hash, nullptr, verify);
+}
+
+// open(const string& path, hash_view_fn hash, bool verify)
+// Maps a snapshot file for a hash function that takes a string_view
+unique_ptr<CarSnapshot> CarSnapshot::open(const string& path, hash_view_fn hash, bool verify) {
+    return map(path, nullptr, hash, verify);
+}
+
+// map(const string& path, hash_fn hash, hash_view_fn viewHash, bool verify)
+// Maps the file and checks its header, nothing is read past the header unless verify is set
+unique_ptr<CarSnapshot> CarSnapshot::map(const string& path, hash_fn hash, hash_view_fn viewHash, bool verify) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return nullptr;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == -1 || static_cast<size_t>(info.st_size) < sizeof(SnapshotHeader)) {
+        close(fd);
+        return nullptr;
+    }
+    void* base = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return nullptr;
+    }
+    
+    // The snapshot owns the mapping from here, so every failure below unmaps it
+    unique_ptr<CarSnapshot> snapshot(new CarSnapshot());
+    snapshot->m_hash = hash;
+    snapshot->m_viewHash = viewHash;
+    snapshot->m_base = base;
+    snapshot->m_length = info.st_size;
+    
+    const SnapshotHeader* header = static_cast<const SnapshotHeader*>(base);
+    const unsigned char* bytes = static_cast<const unsigned char*>(base);
+    if (memcmp(header->m_magic, SNAPSHOTMAGIC, sizeof(SNAPSHOTMAGIC)) != 0 || header->m_version != SNAPSHOTVERSION ||
+        header->m_fileBytes != snapshot->m_length || header->m_capacity < MINPRIME ||
+        header->m_capacity > static_cast<uint32_t>(MAXCAPACITY) ||
+        header->m_recordOffset < sizeof(SnapshotHeader) + header->m_capacity + GROUPWIDTH - 1 ||
+        header->m_stringOffset != header->m_recordOffset + uint64_t(header->m_capacity) * sizeof(Record) ||
+        header->m_stringOffset > header->m_fileBytes ||
+        header->m_hashCheck != snapshot->hashKey(string_view(SNAPSHOTMAGIC, sizeof(SNAPSHOTMAGIC)))) {
+        return nullptr;
+    }
+    if (verify && snapshotChecksum(CHECKSUMSEED, bytes + sizeof(SnapshotHeader), snapshot->m_length - sizeof(SnapshotHeader)) != header->m_checksum) {
+        return nullptr;
+    }
+    
+    snapshot->m_capacity = header->m_capacity;
+    snapshot->m_magic = fastModMagic(header->m_capacity);
+    snapshot->m_count = header->m_count;
+    snapshot->m_ctrl = bytes + sizeof(SnapshotHeader);
+    snapshot->m_records = reinterpret_cast<const Record*>(bytes + header->m_recordOffset);
+    snapshot->m_strings = reinterpret_cast<const char*>(bytes + header->m_stringOffset);
+    snapshot->m_stringBytes = header->m_fileBytes - header->m_stringOffset;
+    snapshot->m_logSequence = header->m_logSequence;
+    return snapshot;
+}
+
+// ~CarSnapshot()
+// Unmaps the file
+CarSnapshot::~CarSnapshot() {
+    if (m_base) {
+        munmap(m_base, m_length);
+    }
+}
+
+// getCar(string_view model, int dealer) const
+// Looks the car up in the mapped buckets with GROUPED probing, returns EMPTY if not found
+Car CarSnapshot::getCar(string_view model, int dealer) const {
+    unsigned int hash = hashKey(model);
+    unsigned char tag = CarDB::fingerprint(hash);
+    unsigned int start = fastMod(hash, m_capacity, m_magic);
+    
+    for (int i = 0; i < m_capacity; i += GROUPWIDTH) {
+        const unsigned char* group = m_ctrl + start;
+        for (unsigned int matches = groupMatch(group, tag); matches != 0; matches &= matches - 1) {
+            unsigned int index = start + __builtin_ctz(matches);
+            if (index >= static_cast<unsigned int>(m_capacity)) index -= m_capacity;
+            const Record& record = m_records[index];
+            if (record.m_dealer == dealer && record.m_modelLength == model.size() &&
+                uint64_t(record.m_modelOffset) + record.m_modelLength <= m_stringBytes &&
+                memcmp(m_strings + record.m_modelOffset, model.data(), model.size()) == 0) {
+                return Car(string(model), record.m_quantity, record.m_dealer, true);
+            }
+        }
+        if (groupMatch(group, CTRLEMPTY) != 0) {
+            break;
+        }
+        start += GROUPWIDTH;
+        if (start >= static_cast<unsigned int>(m_capacity)) start -= m_capacity;
+    }
+    return EMPTY;
+}
+
+// size() const
+// Returns the number of cars in the snapshot
+int CarSnapshot::size() const {
+    return m_count;
+}
+
+// hashKey(string_view model) const
+// Hashes the model with the view hash when there is one, otherwise with the string hash
+unsigned int CarSnapshot::hashKey(string_view model) const {
+    if (m_viewHash) {
+        return m_viewHash(model);
+    }
+    return m_hash(string(model));
+}
+
+// Write-ahead log layout, in native byte order:
+// header | entries, each an entry header followed by the model
+// An entry whose checksum does not match ends the log, it is the torn tail of a crashed write
+// Entries are numbered in the order they are logged, a snapshot records the number of the last one it holds
+const char LOGMAGIC[8] = {'C', 'A', 'R', 'D', 'B', 'W', 'A', 'L'};
+const uint32_t LOGVERSION = 2;
+struct LogHeader {
+    char     m_magic[8];
+    uint32_t m_version;
+    uint32_t m_reserved;
+};
+struct LogEntry {
+    uint32_t m_checksum;    // FNV-1a of the rest of the entry and the model, folded to 32 bits
+    uint32_t m_op;          // LOGINSERT, LOGREMOVE or LOGUPDATE
+    uint64_t m_sequence;    // number of the change, counting up from the first change ever logged
+    uint32_t m_modelLength;
+    int32_t  m_dealer;
+    int32_t  m_quantity;    // quantity inserted or set
+    int32_t  m_previous;    // quantity of the car updated or removed, picks it among duplicates
+};
+
+// logChecksum(const LogEntry& entry, const char* model)
+// Returns the checksum of an entry and its model
+static uint32_t logChecksum(const LogEntry& entry, const char* model) {
+    uint64_t checksum = snapshotChecksum(CHECKSUMSEED, &entry.m_op, sizeof(LogEntry) - sizeof(entry.m_checksum));
+    checksum = snapshotChecksum(checksum, model, entry.m_modelLength);
+    return static_cast<uint32_t>(checksum ^ (checksum >> 32));
+}
+
+// isLogHeader(const unsigned char* bytes, size_t length)
+// Returns true if the bytes start with the header of a log
+static bool isLogHeader(const unsigned char* bytes, size_t length) {
+    const LogHeader* header = reinterpret_cast<const LogHeader*>(bytes);
+    return length >= sizeof(LogHeader) && memcmp(header->m_magic, LOGMAGIC, sizeof(LOGMAGIC)) == 0 &&
+           header->m_version == LOGVERSION;
+}
+
+// openLog(const string& path, int groupSize, int flushMillis)
+// Opens or creates the log and appends the later changes to it
+// A torn entry left at the tail by a crash is cut off so new entries follow the last complete one,
+// and numbering continues after the last complete one
+bool CarDB::openLog(const string& path, int groupSize, int flushMillis) {
+    stopFlusher();
+    if (m_logFd != -1) {
+        syncLog();
+        close(m_logFd);
+        m_logFd = -1;
+    }
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    struct stat info;
+    if (fd == -1 || fstat(fd, &info) == -1) {
+        if (fd != -1) close(fd);
+        return false;
+    }
+    
+    // A new log starts with its header, an existing one is scanned for its complete entries
+    size_t end = sizeof(LogHeader);
+    unsigned long long last = 0;
+    if (info.st_size == 0) {
+        LogHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.m_magic, LOGMAGIC, sizeof(LOGMAGIC));
+        header.m_version = LOGVERSION;
+        if (write(fd, &header, sizeof(header)) != static_cast<ssize_t>(sizeof(header))) {
+            close(fd);
+            return false;
+        }
+    } else {
+        void* base = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        const unsigned char* bytes = static_cast<const unsigned char*>(base);
+        if (base == MAP_FAILED || !isLogHeader(bytes, info.st_size)) {
+            if (base != MAP_FAILED) munmap(base, info.st_size);
+            close(fd);
+            return false;
+        }
+        end += replayLog(bytes + sizeof(LogHeader), info.st_size - sizeof(LogHeader), nullptr, 0, last);
+        munmap(base, info.st_size);
+    }
+    if (ftruncate(fd, end) == -1 || lseek(fd, end, SEEK_SET) == -1 || fdatasync(fd) == -1) {
+        close(fd);
+        return false;
+    }
+    
+    m_logFd = fd;
+    m_logGroup = groupSize > 0 ? groupSize : 1;
+    m_logFlushMillis = flushMillis > 0 ? flushMillis : 0;
+    m_logPending = 0;
+    m_logBuffer.clear();
+    m_logSequence = last > m_logSequence ? last : m_logSequence;
+    if (m_logFlushMillis > 0) {
+        m_stopFlusher = false;
+        m_logFlusher = thread(&CarDB::logFlusher, this);
+    }
+    return true;
+}
+
+// logChange(int op, string_view model, int dealer, int quantity, int previous)
+// Encodes a change at the end of the log buffer, and commits the group once it is full
+// The change is only durable once its group is synced, by a full group, syncLog or the flusher thread
+// Returns false if the log has failed, the caller's change is then not durable
+bool CarDB::logChange(int op, string_view model, int dealer, int quantity, int previous) {
+    if (m_logFd == -1) {
+        return true;
+    }
+    lock_guard<mutex> lock(m_logLock);
+    LogEntry entry = {0, static_cast<uint32_t>(op), ++m_logSequence, static_cast<uint32_t>(model.size()), dealer,
+                      quantity, previous};
+    entry.m_checksum = logChecksum(entry, model.data());
+    m_logBuffer.append(reinterpret_cast<const char*>(&entry), sizeof(entry));
+    m_logBuffer.append(model);
+    if (++m_logPending >= m_logGroup) {
+        return writeLog();
+    }
+    return !m_logFailed;
+}
+
+// syncLog()
+// Writes the buffered changes to the log with one write and makes them durable with one sync
+// Returns false if no log is open or the log has failed
+bool CarDB::syncLog() {
+    if (m_logFd == -1) {
+        return false;
+    }
+    lock_guard<mutex> lock(m_logLock);
+    return writeLog() && !m_logFailed;
+}
+
+// logFailed() const
+// Returns true once a log write or sync failed
+bool CarDB::logFailed() const {
+    return m_logFailed;
+}
+
+// writeLog()
+// Helper function of logChange, syncLog and the flusher thread that writes and syncs the buffer, m_logLock held
+// A failure sets m_logFailed, since a sync that failed once cannot be trusted to have kept the earlier writes
+bool CarDB::writeLog() {
+    size_t written = 0;
+    while (written < m_logBuffer.size()) {
+        ssize_t bytes = write(m_logFd, m_logBuffer.data() + written, m_logBuffer.size() - written);
+        if (bytes == -1 && errno != EINTR) {
+            m_logBuffer.erase(0, written);
+            m_logFailed = true;
+            return false;
+        }
+        written += bytes > 0 ? bytes : 0;
+    }
+    m_logBuffer.clear();
+    m_logPending = 0;
+    if (fdatasync(m_logFd) != 0) {
+        m_logFailed = true;
+        return false;
+    }
+    return true;
+}
+
+// logFlusher()
+// Body of the flusher thread, syncs the pending changes every m_logFlushMillis
+// so none waits for its group longer than that when the changes stop coming
+void CarDB::logFlusher() {
+    unique_lock<mutex> lock(m_logLock);
+    while (!m_stopFlusher) {
+        m_logWake.wait_for(lock, chrono::milliseconds(m_logFlushMillis));
+        if (!m_stopFlusher && m_logPending > 0 && !m_logFailed) {
+            writeLog();
+        }
+    }
+}
+
+// stopFlusher()
+// Stops the flusher thread and waits for it, if it runs
+void CarDB::stopFlusher() {
+    if (!m_logFlusher.joinable()) {
+        return;
+    }
+    {
+        lock_guard<mutex> lock(m_logLock);
+        m_stopFlusher = true;
+    }
+    m_logWake.notify_all();
+    m_logFlusher.join();
+}
+
+// checkpoint(const string& snapshotPath)
+// Saves a durable snapshot, then empties the log
+// The snapshot records the number of the last change it holds and recovery skips the entries up to it,
+// so a crash between the two does not apply any change twice
+// After a log failure the pending changes are dropped rather than written since the snapshot holds them,
+// and a successful checkpoint lets the database take changes again
+bool CarDB::checkpoint(const string& snapshotPath) {
+    if (m_logFd != -1) {
+        lock_guard<mutex> lock(m_logLock);
+        if (m_logFailed) {
+            m_logBuffer.clear();
+            m_logPending = 0;
+        } else if (!writeLog()) {
+            return false;
+        }
+    }
+    if (!saveSnapshot(snapshotPath)) {
+        return false;
+    }
+    if (m_logFd == -1) {
+        m_logFailed = false;
+        return true;
+    }
+    lock_guard<mutex> lock(m_logLock);
+    if (ftruncate(m_logFd, sizeof(LogHeader)) == 0 && lseek(m_logFd, sizeof(LogHeader), SEEK_SET) != -1 &&
+        fdatasync(m_logFd) == 0) {
+        m_logFailed = false;
+        return true;
+    }
+    return false;
+}
+
+// recover(const string& snapshotPath, const string& logPath)
+// Loads every car of the snapshot with one batch insert, then replays the log entries written after it
+bool CarDB::recover(const string& snapshotPath, const string& logPath) {
+    if (m_logFd != -1) {
+        return false;
+    }
+    
+    unsigned long long after = 0;
+    if (access(snapshotPath.c_str(), F_OK) == 0) {
+        unique_ptr<CarSnapshot> snapshot = CarSnapshot::map(snapshotPath, m_hash, m_viewHash, true);
+        if (!snapshot) {
+            return false;
+        }
+        vector<Car> cars;
+        cars.reserve(snapshot->m_count);
+        for (int i = 0; i < snapshot->m_capacity; i++) {
+            const CarSnapshot::Record& record = snapshot->m_records[i];
+            if (!(snapshot->m_ctrl[i] & CTRLEMPTY) && uint64_t(record.m_modelOffset) + record.m_modelLength <= snapshot->m_stringBytes) {
+                cars.emplace_back(string(snapshot->m_strings + record.m_modelOffset, record.m_modelLength),
+                                  record.m_quantity, record.m_dealer, true);
+            }
+        }
+        insertBatch(std::move(cars));
+        after = snapshot->m_logSequence;
+    }
+    m_logSequence = after > m_logSequence ? after : m_logSequence;
+    
+    int fd = ::open(logPath.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return errno == ENOENT;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == -1) {
+        close(fd);
+        return false;
+    }
+    if (info.st_size == 0) {
+        close(fd);
+        return true;
+    }
+    void* base = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return false;
+    }
+    const unsigned char* bytes = static_cast<const unsigned char*>(base);
+    bool valid = isLogHeader(bytes, info.st_size);
+    if (valid) {
+        unsigned long long last = 0;
+        replayLog(bytes + sizeof(LogHeader), info.st_size - sizeof(LogHeader), this, after, last);
+        m_logSequence = last > m_logSequence ? last : m_logSequence;
+    }
+    munmap(base, info.st_size);
+    return valid;
+}
+
+// findLogged(string_view model, int dealer, int quantity, bool& old, int& index)
+// Helper function of the log replay that finds the bucket of the car a logged update or remove changed
+// Among cars with the same model and dealer id it picks the one with the quantity, searching the dealer's list
+// when the probe finds another one, and falls back to the one probed if none has it
+// Returns false if no car has the model and dealer id
+bool CarDB::findLogged(string_view model, int dealer, int quantity, bool& old, int& index) {
+    const Car* car = findCar(model, dealer);
+    if (!car) {
+        return false;
+    }
+    if (car->m_quantity != quantity && dealer >= MINID && dealer <= MAXID && !m_dealerCars.empty()) {
+        for (unsigned int bucket : m_dealerCars[dealer - MINID]) {
+            const Car* table = (bucket & 0x80000000u) == m_currentTag ? m_currentTable : m_oldTable;
+            const Car& candidate = table[bucket & 0x7FFFFFFFu];
+            if (candidate.m_quantity == quantity && candidate.m_model == model) {
+                car = &candidate;
+                break;
+            }
+        }
+    }
+    old = m_oldTable && car >= m_oldTable && car < m_oldTable + m_oldCap;
+    index = static_cast<int>(car - (old ? m_oldTable : m_currentTable));
+    return true;
+}
+
+// replayLog(const unsigned char* bytes, size_t length, CarDB* db, unsigned long long after, unsigned long long& last)
+// Applies the complete entries numbered after the given one to the database, or only checks them when db is nullptr
+// Inserts are replayed as inserts, so duplicates come back, and updates and removes change the same car they did
+// Returns the length of the complete entries and sets last to the number of the last one
+size_t CarDB::replayLog(const unsigned char* bytes, size_t length, CarDB* db, unsigned long long after, unsigned long long& last) {
+    size_t offset = 0;
+    while (length - offset >= sizeof(LogEntry)) {
+        LogEntry entry;
+        memcpy(&entry, bytes + offset, sizeof(entry));
+        const char* model = reinterpret_cast<const char*>(bytes + offset + sizeof(entry));
+        if (entry.m_modelLength > length - offset - sizeof(entry) || entry.m_checksum != logChecksum(entry, model)) {
+            break;
+        }
+        offset += sizeof(entry) + entry.m_modelLength;
+        last = entry.m_sequence;
+        if (!db || entry.m_sequence <= after) {
+            continue;
+        }
+        
+        string_view view(model, entry.m_modelLength);
+        bool old;
+        int index;
+        if (entry.m_op == LOGINSERT) {
+            db->insert(Car(string(view), entry.m_quantity, entry.m_dealer, true));
+        } else if (entry.m_op == LOGREMOVE && db->findLogged(view, entry.m_dealer, entry.m_previous, old, index)) {
+            db->eraseAt(old, index);
+            if ((!old && db->deletedRatio() > 0.8) || (old && db->m_oldNumDeleted == db->m_oldSize)) {
+                db->rehash();
+            }
+        } else if (entry.m_op == LOGUPDATE && db->findLogged(view, entry.m_dealer, entry.m_previous, old, index)) {
+            db->setQuantity((old ? db->m_oldTable : db->m_currentTable)[index], entry.m_quantity);
+        }
+    }
+    return offset;
+}
+
+// Operation trace layout: header | records
+// A record is its op byte, with TRACEUSED set for a used car, then varints: nanoseconds since the previous record,
+// dealer, value, model length, followed by the model, the cars of a batch and the result varint,
+// upsert and adjustQuantity add the previous quantity after it, getCar adds 1 if it found the car and 0 if not
+// A batch car is its dealer, quantity, used byte, model length and model; signed varints are zigzag encoded
+const char TRACEMAGIC[8] = {'C', 'A', 'R', 'D', 'B', 'T', 'R', 'C'};
+const uint32_t TRACEVERSION = 3;
+const unsigned char TRACEUSED = 0x80;
+const size_t TRACEFLUSH = 1 << 16; // buffered bytes written to the trace at once
+struct TraceHeader {
+    char     m_magic[8];
+    uint32_t m_version;
+    int32_t  m_capacity;    // table of the CarDB when the trace started
+    int32_t  m_policy;
+    uint32_t m_reserved;
+};
+
+// steadyNanos()
+// Returns the steady clock time in nanoseconds
+static long long steadyNanos() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+const int VARINTBYTES = 10;        // longest varint of a 64-bit value
+
+// putVarint(char* out, uint64_t value)
+// Writes the value seven bits per byte, the high bit of a byte set when more bytes follow
+// Returns the end of the bytes written
+static char* putVarint(char* out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = static_cast<char>(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = static_cast<char>(value);
+    return out;
+}
+
+// putSigned(char* out, long long value)
+// Writes a signed value zigzag encoded, so small negative values stay short
+static char* putSigned(char* out, long long value) {
+    return putVarint(out, (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+}
+
+// getVarint(const unsigned char*& at, const unsigned char* end, uint64_t& value)
+// Reads a varint and moves past it, returns false if it runs past the end
+static bool getVarint(const unsigned char*& at, const unsigned char* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; at < end && shift < 64; shift += 7) {
+        unsigned char byte = *at++;
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// getSigned(const unsigned char*& at, const unsigned char* end, int& value)
+// Reads a zigzag encoded varint, returns false if it runs past the end
+static bool getSigned(const unsigned char*& at, const unsigned char* end, int& value) {
+    uint64_t encoded;
+    if (!getVarint(at, end, encoded)) {
+        return false;
+    }
+    value = static_cast<int>(static_cast<long long>(encoded >> 1) ^ -static_cast<long long>(encoded & 1));
+    return true;
+}
+
+// getModel(const unsigned char*& at, const unsigned char* end, string& model)
+// Reads a model length and the model, returns false if they run past the end
+static bool getModel(const unsigned char*& at, const unsigned char* end, string& model) {
+    uint64_t length;
+    if (!getVarint(at, end, length) || length > static_cast<uint64_t>(end - at)) {
+        return false;
+    }
+    model.assign(reinterpret_cast<const char*>(at), length);
+    at += length;
+    return true;
+}
+
+// startTrace(const string& path)
+// Creates the trace and records the later calls to it
+// The cars already stored come first as one batch, so a replay starts from the same contents
+bool CarDB::startTrace(const string& path) {
+    stopTrace();
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return false;
+    }
+    TraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.m_magic, TRACEMAGIC, sizeof(TRACEMAGIC));
+    header.m_version = TRACEVERSION;
+    header.m_capacity = m_currentCap;
+    header.m_policy = m_currProbing;
+    if (write(fd, &header, sizeof(header)) != static_cast<ssize_t>(sizeof(header))) {
+        close(fd);
+        return false;
+    }
+
+    m_traceFd = fd;
+    m_traceBuffer.clear();
+    m_traceBuffer.reserve(TRACEFLUSH + 256);
+    m_traceLast = steadyNanos();
+    m_traceInCall = false;
+    vector<Car> cars;
+    auto addTable = [&](const Car* table, const unsigned char* ctrl, int capacity) {
+        for (int i = 0; i < capacity; i++) {
+            if (!(ctrl[i] & CTRLEMPTY)) {
+                cars.push_back(table[i]);
+            }
+        }
+    };
+    addTable(m_currentTable, m_currentCtrl, m_currentCap);
+    if (m_oldTable) {
+        addTable(m_oldTable, m_oldCtrl, m_oldCap);
+    }
+    traceCall(TRACEBATCH, "", 0, static_cast<int>(cars.size()), false);
+    traceCars(cars);
+    traceResult(static_cast<int>(cars.size()));
+    return true;
+}
+
+// stopTrace()
+// Writes the buffered records and closes the trace, returns false if a write failed or no trace was open
+bool CarDB::stopTrace() {
+    if (m_traceFd == -1) {
+        return false;
+    }
+    bool written = flushTrace();
+    if (m_traceFd != -1) {
+        close(m_traceFd);
+        m_traceFd = -1;
+    }
+    return written;
+}
+
+// traceCall(int op, string_view model, int dealer, int value, bool used) const
+// Encodes a call up to its result, which traceResult appends once the call returns
+// Returns false for a call made by a traced call, which is not recorded again
+bool CarDB::traceCall(int op, string_view model, int dealer, int value, bool used) const {
+    if (m_traceInCall) {
+        return false;
+    }
+    m_traceInCall = true;
+    long long now = steadyNanos();
+    char head[1 + 4 * VARINTBYTES];
+    char* end = head;
+    *end++ = static_cast<char>(op | (used ? TRACEUSED : 0));
+    end = putVarint(end, static_cast<uint64_t>(now - m_traceLast));
+    end = putSigned(end, dealer);
+    end = putSigned(end, value);
+    end = putVarint(end, model.size());
+    m_traceBuffer.append(head, end - head);
+    m_traceBuffer.append(model);
+    m_traceLast = now;
+    return true;
+}
+
+// traceCars(const vector<Car>& cars) const
+// Encodes the cars of the batch being traced
+void CarDB::traceCars(const vector<Car>& cars) const {
+    for (const Car& car : cars) {
+        char head[1 + 3 * VARINTBYTES];
+        char* end = putSigned(head, car.m_dealer);
+        end = putSigned(end, car.m_quantity);
+        *end++ = static_cast<char>(car.m_used);
+        end = putVarint(end, car.m_model.size());
+        m_traceBuffer.append(head, end - head);
+        m_traceBuffer.append(car.m_model);
+    }
+}
+
+// traceResult(int result) const
+// Ends the record of the traced call with its result, writing the buffer out once it is large
+void CarDB::traceResult(int result) const {
+    char tail[VARINTBYTES];
+    m_traceBuffer.append(tail, putSigned(tail, result) - tail);
+    m_traceInCall = false;
+    if (m_traceBuffer.size() >= TRACEFLUSH) {
+        flushTrace();
+    }
+}
+
+// traceResult(int result, int previous) const
+// Ends the record of a traced upsert or adjustQuantity with its result and the previous quantity,
+// or of a traced getCar with the quantity and whether the car was found
+void CarDB::traceResult(int result, int previous) const {
+    char tail[VARINTBYTES];
+    m_traceBuffer.append(tail, putSigned(tail, result) - tail);
+    traceResult(previous);
+}
+
+// flushTrace() const
+// Writes the buffered records without syncing them, the trace is closed if the write fails
+// so a full disk stops the recording instead of the database
+bool CarDB::flushTrace() const {
+    size_t written = 0;
+    while (written < m_traceBuffer.size()) {
+        ssize_t bytes = write(m_traceFd, m_traceBuffer.data() + written, m_traceBuffer.size() - written);
+        if (bytes == -1 && errno != EINTR) {
+            close(m_traceFd);
+            m_traceFd = -1;
+            m_traceBuffer.clear();
+            return false;
+        }
+        written += bytes > 0 ? bytes : 0;
+    }
+    m_traceBuffer.clear();
+    return true;
+}
+
+// loadTrace(const string& path, TraceInfo& info, vector<TraceRecord>& records)
+// Decodes every complete record of a trace, the times made relative to the start of the trace
+bool CarDB::loadTrace(const string& path, TraceInfo& info, vector<TraceRecord>& records) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    struct stat fileInfo;
+    if (fd == -1 || fstat(fd, &fileInfo) == -1 || static_cast<size_t>(fileInfo.st_size) < sizeof(TraceHeader)) {
+        if (fd != -1) close(fd);
+        return false;
+    }
+    void* base = mmap(nullptr, fileInfo.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return false;
+    }
+    const unsigned char* bytes = static_cast<const unsigned char*>(base);
+    TraceHeader header;
+    memcpy(&header, bytes, sizeof(header));
+    if (memcmp(header.m_magic, TRACEMAGIC, sizeof(TRACEMAGIC)) != 0 || header.m_version != TRACEVERSION) {
+        munmap(base, fileInfo.st_size);
+        return false;
+    }
+    info.m_capacity = header.m_capacity;
+    info.m_policy = static_cast<prob_t>(header.m_policy);
+
+    const unsigned char* at = bytes + sizeof(header);
+    const unsigned char* end = bytes + fileInfo.st_size;
+    long long nanos = 0;
+    records.clear();
+    while (at < end) {
+        TraceRecord record;
+        uint64_t delta;
+        unsigned char op = *at++;
+        record.m_op = static_cast<trace_t>(op & ~TRACEUSED);
+        record.m_used = op & TRACEUSED;
+        bool complete = getVarint(at, end, delta) && getSigned(at, end, record.m_dealer) &&
+                        getSigned(at, end, record.m_value) && getModel(at, end, record.m_model);
+        for (int i = 0; complete && record.m_op == TRACEBATCH && i < record.m_value; i++) {
+            Car car;
+            complete = getSigned(at, end, car.m_dealer) && getSigned(at, end, car.m_quantity) && at < end;
+            if (complete) {
+                car.m_used = *at++;
+                complete = getModel(at, end, car.m_model);
+                record.m_cars.push_back(std::move(car));
+            }
+        }
+        int found = 0;
+        if (!complete || !getSigned(at, end, record.m_result) ||
+            ((record.m_op == TRACEUPSERT || record.m_op == TRACEADJUST) && !getSigned(at, end, record.m_previous)) ||
+            (record.m_op == TRACEGETCAR && !getSigned(at, end, found))) {
+            break;
+        }
+        record.m_found = found != 0;
+        nanos += delta;
+        record.m_nanos = nanos;
+        records.push_back(std::move(record));
+    }
+    munmap(base, fileInfo.st_size);
+    return true;
+}
+
+// replayCall(const TraceRecord& record, int* previous, bool* found)
+// Makes the call of a record on this database
+// Returns the result as the trace records it, so a replay can tell where it diverges from the recording
+int CarDB::replayCall(const TraceRecord& record, int* previous, bool* found) {
+    switch (record.m_op) {
+        case TRACEINSERT: return insert(Car(record.m_model, record.m_value, record.m_dealer, record.m_used));
+        case TRACEREMOVE: return remove(record.m_model, record.m_dealer);
+        case TRACEUPDATE: return updateQuantity(string_view(record.m_model), record.m_dealer, record.m_value);
+        case TRACEUPSERT: return upsert(Car(record.m_model, record.m_value, record.m_dealer, record.m_used), previous);
+        case TRACEADJUST: return adjustQuantity(record.m_model, record.m_dealer, record.m_value, previous);
+        case TRACEBATCH:  return insertBatch(record.m_cars);
+        case TRACEPOLICY:
+            changeProbPolicy(static_cast<prob_t>(record.m_value));
+            return 0;
+        case TRACEGETCAR: {
+            Car car = getCar(record.m_model, record.m_dealer);
+            if (found) *found = !car.m_model.empty();
+            return car.m_quantity;
+        }
+    }
+    return -1;
 }
 
 ostream& operator<<(ostream& sout, const Car &car ) {
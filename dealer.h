@@ -3,31 +3,71 @@
 #define DEALER_H
 #include <iostream>
 #include <string>
+#include <string_view>
+#include <utility>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <unordered_map>
 #include "math.h"
 using namespace std;
 class Grader;
 class Tester;
 class Car;
 class CarDB;
+class ConcurrentCarDB;
+class CarSnapshot;
+struct ReaderSlot;
 const int MINID = 1000;     // dealer ID
 const int MAXID = 9999;     // dealer ID
 const int MINPRIME = 101;   // Min size for hash table
-const int MAXPRIME = 99991; // Max size for hash table
+const int MAXPRIME = 99991; // Max size for hash table searched prime by prime
+const int MAXCAPACITY = 1610612741; // Max size for hash table grown through the prime ladder
+const unsigned char CTRLEMPTY = 0x80;   // control byte of a bucket that never held data
+const unsigned char CTRLDELETED = 0xFE; // control byte of a bucket whose data was removed
+const int GROUPWIDTH = 16;              // control bytes compared at once by the GROUPED policy
 #define EMPTY Car("",0,0,false)
 typedef unsigned int (*hash_fn)(string); // declaration of hash function
-enum prob_t {NONE, QUADRATIC, DOUBLEHASH}; // types of collision handling policy
+typedef unsigned int (*hash_view_fn)(string_view); // hash function that hashes without a string copy
+enum prob_t {NONE, QUADRATIC, DOUBLEHASH, GROUPED, ROBINHOOD}; // types of collision handling policy
+typedef void* (*table_alloc_fn)(void* context, size_t bytes);              // returns a table's buckets, nullptr if out of memory
+typedef void (*table_release_fn)(void* context, void* buckets, size_t bytes); // takes back buckets with their size
+// Where a CarDB gets the bucket arrays of its tables, given to its constructor
+// The buckets may be returned uninitialized, a car is constructed in a bucket when it is first used
+// Left empty, or with either function missing, the tables come from calloc and go back to free
+struct TableAllocator{
+    table_alloc_fn   m_allocate = nullptr;
+    table_release_fn m_release = nullptr;
+    void*            m_context = nullptr; // passed to both, an arena or pool of the caller
+};
+// wyhash-style hash of a model, a ready-made hash_view_fn whose bits are all well mixed
+unsigned int wyHash(string_view model);
 #define DEFPOLCY QUADRATIC
+// Building with CARDB_STATS defined collects the counters of CarDB::stats(), otherwise they are compiled out
+#ifdef CARDB_STATS
+const bool STATSENABLED = true;
+#else
+const bool STATSENABLED = false;
+#endif
+const int PROBEBUCKETS = 16; // probe lengths counted one by one, longer ones share the last count
 
 class Car{
     friend class Tester;
     friend class Grader;
     friend class CarDB;
+    friend class ConcurrentCarDB;
+    friend class CarSnapshot;
     public:
     Car(string model = "", int quantity = 0, int dealer = 0, bool used = false) {
-        m_model = model;
+        m_model = std::move(model);
         m_quantity = quantity;
         m_dealer = dealer;
         m_used = used;
+        m_dealerPos = 0;
     }
     void setModel(string model){m_model=model;}
     void setQuantity(int quantity){m_quantity=quantity;}
@@ -37,6 +77,9 @@ class Car{
     int getQuantity() const {return m_quantity;}
     int getDealer() const {return m_dealer;}
     bool getUsed() const {return m_used;}
+    Car(const Car& rhs) = default;
+    Car(Car&& rhs) = default;
+    Car& operator=(Car&& rhs) = default;
     // overloaded assignment operator
     const Car& operator=(const Car& rhs){
         if (this != &rhs){
@@ -59,57 +102,416 @@ class Car{
     // if it is set to false, it means the bucket in the hash table is free for insert
     // if it is set to true, it means the bucket contains live data, and we cannot overwrite it
     bool m_used;
+    int m_dealerPos;    // position in its dealer's list of the CarDB secondary index, fits in the padding after m_used
+};
+
+// Totals of one model across all dealers, kept up to date by CarDB
+struct ModelTotals{
+    long long m_quantity = 0; // sum of the quantities
+    int       m_dealers = 0;  // number of cars with the model
+};
+
+// Copy of a bucket's key and quantity for the lock-free readers of a ConcurrentCarDB shard
+// Every field is written and read with atomic operations, since readers look at it while a writer changes it
+// A model that fits is copied into m_inline, a longer one is read from the car's own buffer through m_model,
+// which the shard frees only once no reader can still hold its address
+struct BucketKey{
+    unsigned long long m_inline[3]; // the model when it is at most sizeof(m_inline) bytes
+    const char*  m_model;           // the car's model buffer otherwise, nullptr when the model is inline
+    unsigned int m_length;          // length of the model
+    int          m_dealer;
+    int          m_quantity;
+};
+
+// Probe lengths of the lookups, a probe of the grouped scan is a group of GROUPWIDTH buckets
+struct ProbeHistogram{
+    long long m_counts[PROBEBUCKETS] = {}; // m_counts[i] lookups took i + 1 probes, the last one counts the longer ones too
+    long long m_probes = 0;   // probes of all lookups
+    int       m_max = 0;      // longest lookup
+};
+
+// Counters of a CarDB, they stay zero unless built with CARDB_STATS
+// The table fields at the end are filled in by stats() either way
+struct CarDBStats{
+    long long m_lookups = 0;        // getCar, findCar, getCars keys and the lookups of updates
+    long long m_lookupMisses = 0;
+    long long m_inserts = 0;
+    long long m_insertFailures = 0; // inserts that found no free bucket after a full probe cycle
+    long long m_removes = 0;
+    long long m_removeMisses = 0;
+    long long m_updates = 0;
+    long long m_updateMisses = 0;
+    long long m_filterSkips = 0;    // table probes a Bloom filter ruled out
+    ProbeHistogram m_probes;        // probes of each lookup across both tables
+    long long m_rehashSteps = 0;    // incremental rehash steps
+    long long m_migrations = 0;     // migrations started
+    long long m_migrationsDone = 0; // migrations whose old table was drained
+    long long m_rehashNanos = 0;    // time spent in rehash steps
+    long long m_migrationNanos = 0; // time the migration in flight has spent in rehash steps so far
+    long long m_lastMigrationNanos = 0; // time the last drained migration spent in rehash steps
+    int m_capacity = 0;
+    int m_live = 0;
+    int m_deleted = 0;              // tombstones of the current table
+    int m_oldCapacity = 0;          // 0 when no migration is in flight
+    int m_oldLive = 0;              // cars left to transfer
+    int m_oldDeleted = 0;
+    int m_oldCursor = 0;            // next old bucket to transfer
+};
+
+// Kinds of call recorded by CarDB::startTrace
+enum trace_t {TRACEINSERT = 1, TRACEREMOVE, TRACEGETCAR, TRACEUPDATE, TRACEUPSERT, TRACEADJUST, TRACEPOLICY, TRACEBATCH};
+
+// One call read back from a trace
+struct TraceRecord{
+    trace_t   m_op = TRACEINSERT;
+    long long m_nanos = 0;  // time of the call since the trace started
+    string    m_model;
+    int       m_dealer = 0;
+    int       m_value = 0;  // quantity, delta of adjustQuantity or policy of changeProbPolicy
+    bool      m_used = false;
+    int       m_result = 0; // value the call returned, for getCar the quantity found or 0
+    bool      m_found = false; // getCar found the car, a quantity of its own can be any value
+    int       m_previous = 0; // previous quantity reported by upsert and adjustQuantity
+    vector<Car> m_cars;     // cars of an insertBatch
+};
+
+// Table of the CarDB when its trace started
+struct TraceInfo{
+    int    m_capacity = 0;
+    prob_t m_policy = NONE;
 };
 
 class CarDB{
     public:
     friend class Grader;
     friend class Tester;
-    CarDB(int size, hash_fn hash, prob_t probing);
+    friend class ConcurrentCarDB;
+    friend class CarSnapshot;
+    CarDB(int size, hash_fn hash, prob_t probing, TableAllocator allocator = TableAllocator());
+    CarDB(int size, hash_view_fn hash, prob_t probing, TableAllocator allocator = TableAllocator());
     ~CarDB();
     // Returns Load factor of the new table
     float lambda() const;
     // Returns the ratio of deleted slots in the new table
     float deletedRatio() const;
     // insert only happens in the new table
-    bool insert(Car car);
+    bool insert(const Car& car);
+    bool insert(Car&& car);
+    bool emplace(string model, int quantity, int dealer);
+    // loads many objects with a single resize, returns the number inserted
+    int insertBatch(vector<Car> cars);
     // remove can happen from either table
-    bool remove(Car car);
+    bool remove(const Car& car);
+    bool remove(string_view model, int dealer);
     // find can happen in either table
     Car getCar(string model, int dealer) const;
+    // returns the stored car without copying it, nullptr if not found
+    const Car* findCar(string_view model, int dealer) const;
+    // looks up many keys at once, results[i] is the stored car for keys[i] or nullptr
+    void getCars(const vector<pair<string_view, int>>& keys, vector<const Car*>& results) const;
+    // calls fn on every car of the dealer, returns the number of cars
+    // fn must not change the database
+    int forEachCarOfDealer(int dealer, const function<void(const Car&)>& fn) const;
+    // returns the totals of the model, zero if no dealer has it or the totals are not kept
+    ModelTotals modelTotals(string_view model) const;
+    // keeps the totals of each model for modelTotals, at the cost of a hash map update on every change
+    void useModelTotals(bool enabled);
     // update the information
-    bool updateQuantity(Car car, int quantity);
+    bool updateQuantity(const Car& car, int quantity);
+    bool updateQuantity(string_view model, int dealer, int quantity);
+    // inserts the car or sets the quantity of the stored one, finding either in a single probe pass
+    // returns false if the dealer id is invalid or the table is full,
+    // otherwise sets previous, when given, to the previous quantity or 0 for a new car
+    bool upsert(Car car, int* previous = nullptr);
+    // adds delta to the quantity of the car, inserting it with a quantity of delta if missing
+    // returns false and sets previous like upsert
+    bool adjustQuantity(string_view model, int dealer, int delta, int* previous = nullptr);
     void changeProbPolicy(prob_t policy);
+    // bounds the work of each incremental rehash step
+    void setMigrationBudget(int buckets);
+    // keeps a Bloom filter of the (model, dealer) keys of each table, so most misses skip probing the buckets
+    void useFilter(bool enabled);
     void dump() const;
+    // returns the counters and the state of the tables
+    CarDBStats stats() const;
+    // writes stats() as one line of JSON
+    void dumpStats(ostream& sout = cout) const;
+    // writes every live car to a file that CarSnapshot::open maps back, returns false on an I/O error
+    bool saveSnapshot(const string& path) const;
+    // appends every later insert, remove and update to a log, syncing it to disk once per groupSize of them
+    // and at least every flushMillis while any are pending, 0 leaves them pending until their group fills
+    // returns false if the file cannot be opened or is not a log
+    bool openLog(const string& path, int groupSize = 1024, int flushMillis = 10);
+    // writes the logged changes still pending and syncs them to disk
+    bool syncLog();
+    // returns true once a log write or sync failed, changes are then refused until a checkpoint succeeds
+    bool logFailed() const;
+    // saves a snapshot, then empties the log since the snapshot holds its changes
+    bool checkpoint(const string& snapshotPath);
+    // loads the snapshot and replays the log written after it, either file may be missing
+    // must be called before openLog, returns false if the snapshot or the log header is corrupted
+    bool recover(const string& snapshotPath, const string& logPath);
+    // records every later insert, insertBatch, remove, getCar, updateQuantity, upsert, adjustQuantity and changeProbPolicy
+    // with its time and result to a binary trace, which starts with a batch of the cars already stored
+    // returns false if the file cannot be created
+    bool startTrace(const string& path);
+    // writes the records still buffered and closes the trace
+    bool stopTrace();
+    // reads a trace back, dropping a record cut off at its end
+    // returns false if the file is missing or is not a trace
+    static bool loadTrace(const string& path, TraceInfo& info, vector<TraceRecord>& records);
+    // makes a recorded call again, returns its result in the form of TraceRecord::m_result
+    // and sets previous and found, when given, like TraceRecord::m_previous and TraceRecord::m_found
+    int replayCall(const TraceRecord& record, int* previous = nullptr, bool* found = nullptr);
     // int getCap() const {return m_currentCap;}
 
     private:
+    struct Drained{
+        Car* m_table;
+        unsigned char* m_ctrl;
+        int m_capacity;
+        BucketKey* m_keys;
+    };
     hash_fn    m_hash;          // hash function
+    hash_view_fn m_viewHash;    // hash function taking a view, used instead of m_hash when set
     prob_t     m_newPolicy;     // stores the change of policy request
 
+    // The buckets are raw memory until first used: a Car exists only in a bucket whose control byte is not
+    // CTRLEMPTY, so code reading the tables directly, friends included, checks the control byte first
     Car*       m_currentTable;  // hash table
+    unsigned char* m_currentCtrl; // control byte per bucket, CTRLEMPTY, CTRLDELETED or the 7-bit fingerprint of the live car
     int        m_currentCap;    // hash table size (capacity)
+    unsigned long long m_currentMagic; // fastmod constant that reduces a hash modulo m_currentCap
     int        m_currentSize;   // current number of entries
                                 // m_currentSize includes deleted entries
     int        m_currNumDeleted;// number of deleted entries
     prob_t     m_currProbing;       // collision handling policy
+    unsigned int* m_currentDist; // distance of each live bucket from its home bucket, only for ROBINHOOD
+    unsigned long long* m_currentFilter; // Bloom filter of the keys placed in the current table, nullptr when not used
+    BucketKey* m_currentKeys;   // reader copy of each bucket's key, only kept for the shards of a ConcurrentCarDB
 
-    Car*       m_oldTable;      // hash table
+    Car*       m_oldTable;      // hash table, its buckets raw memory like the current table's
+    unsigned char* m_oldCtrl;   // control bytes of the old table
     int        m_oldCap;        // hash table size (capacity)
+    unsigned long long m_oldMagic; // fastmod constant that reduces a hash modulo m_oldCap
     int        m_oldSize;       // current number of entries
                                 // m_oldSize includes deleted entries
     int        m_oldNumDeleted; // number of deleted entries
     prob_t     m_oldProbing;    // collision handling policy
+    unsigned long long* m_oldFilter; // Bloom filter of the old table, nullptr when not used
+    BucketKey* m_oldKeys;       // reader copy of the old table's keys, nullptr when m_currentKeys is
+    int        m_oldCursor;     // next old bucket the incremental rehash visits
+    int        m_migrateBudget; // old buckets visited per rehash step, 0 for 25% of the old table
+    TableAllocator m_allocator; // source of the bucket arrays
+    bool       m_deferFree;     // when set, drained old tables go to m_retired for the owner to free
+    bool       m_useFilter;     // when set, each new table gets a Bloom filter
+    bool       m_useModelTotals; // when set, m_modelTotals follows every change
+    bool       m_backgroundMigration; // when set, a ConcurrentCarDB worker drains the old table, writers only help when it falls behind
+    vector<Drained> m_retired;  // drained old tables waiting for the owner to free them
+    vector<string> m_retiredModels; // models taken out of overwritten buckets while m_deferFree is set, for the owner to free
+    // Secondary index: the buckets of each dealer's cars, a bucket is its index with the table's tag in the top bit
+    vector<vector<unsigned int>> m_dealerCars; // one list per dealer id, allocated on the first insert
+    unsigned int m_currentTag;  // top bit of the current table's buckets in the index, the old table has the other
+    unordered_map<string, ModelTotals> m_modelTotals; // totals of each model held by at least one dealer, empty unless m_useModelTotals
+    int        m_logFd;         // write-ahead log file, -1 when the changes are not logged
+    string     m_logBuffer;     // encoded changes not yet written to the log
+    int        m_logGroup;      // changes written and synced together
+    int        m_logPending;    // changes in m_logBuffer
+    int        m_logFlushMillis; // longest wait of a pending change for its sync, 0 for no limit
+    unsigned long long m_logSequence; // sequence number of the last logged change, snapshots record it
+    atomic<bool> m_logFailed;   // set when a log write or sync failed
+    mutex      m_logLock;       // guards the log buffer between the caller and the flusher thread
+    condition_variable m_logWake; // wakes the flusher thread to stop it
+    bool       m_stopFlusher;   // asks the flusher thread to return
+    thread     m_logFlusher;    // syncs the pending changes every m_logFlushMillis, not joinable when stopped
+    mutable CarDBStats m_stats; // counters of stats(), only updated with CARDB_STATS
+    mutable int m_traceFd;      // operation trace file, -1 when the calls are not traced
+    mutable string m_traceBuffer; // encoded calls not yet written to the trace
+    mutable long long m_traceLast; // steady clock time of the last traced call, in nanoseconds
+    mutable bool m_traceInCall; // set while a traced call runs, so the calls it makes are not recorded again
 
     //private helper functions
-    bool isPrime(int number);
-    int findNextPrime(int current);
+    static bool isPrime(int number);
+    static int findNextPrime(int current);
+    unsigned int hashKey(string_view model) const;
+    int findIndex(const Car* table, const unsigned char* ctrl, int capacity, unsigned long long magic, prob_t policy, unsigned int hash, string_view model, int dealer, int* probes = nullptr) const;
+    int findFreeSlot(const unsigned char* ctrl, int capacity, unsigned long long magic, prob_t policy, unsigned int hash) const;
+    template <prob_t Policy>
+    static int findIndexWith(const Car* table, const unsigned char* ctrl, int capacity, unsigned long long magic, unsigned int hash, string_view model, int dealer, int& probes);
+    template <prob_t Policy, bool Shared = false, class Match>
+    static int probeWith(const unsigned char* ctrl, int capacity, unsigned long long magic, unsigned int hash, int& probes, Match match);
+    const Car* findInTables(unsigned int hash, string_view model, int dealer) const;
+    Car* findForUpsert(unsigned int hash, string_view model, int dealer, int& freeSlot);
+    template <prob_t Policy>
+    static int findOrFreeWith(const Car* table, const unsigned char* ctrl, int capacity, unsigned long long magic, unsigned int hash, string_view model, int dealer, int& freeSlot);
+    int placeCarAt(int index, Car&& car, unsigned int hash);
+    bool finishInsert(int index);
+    bool setQuantity(Car& car, int quantity);
+    void eraseAt(bool old, int index);
+    void recordLookup(int probes, bool found) const;
+    static bool oldTableFirst(unsigned int hash, int oldCapacity, unsigned long long oldMagic, int oldCursor);
+    static float maxLambda(prob_t policy);
+    Car* newTable(int capacity) const;
+    void freeTable(Car* table, unsigned char* ctrl, int capacity) const;
+    static unsigned char* newCtrl(int capacity);
+    static void setCtrl(unsigned char* ctrl, int capacity, int index, unsigned char value);
+    static unsigned char fingerprint(unsigned int hash);
+    unsigned int probeIndex(unsigned int hash, int i, int capacity, prob_t policy) const;
 
     /******************************************
     * Private function declarations go here! *
     ******************************************/
    
     void rehash();
+    void stepMigration();
+    void startMigration(int newCap);
+    bool migrate(int visitLimit);
+    int placeCar(Car&& car, unsigned int hash);
+    int placeRobinHood(Car&& car, unsigned int hash);
+    void eraseRobinHood(int index);
+    void retireModel(Car& car);
+    void shareTables();
+    void shareKey(int index);
+    BucketKey* keyOf(const Car& car);
+    void indexAdd(int index);
+    void indexMove(int index);
+    void indexRemove(bool old, int index);
+    bool logChange(int op, string_view model, int dealer, int quantity, int previous);
+    bool writeLog();
+    void logFlusher();
+    void stopFlusher();
+    bool findLogged(string_view model, int dealer, int quantity, bool& old, int& index);
+    static size_t replayLog(const unsigned char* bytes, size_t length, CarDB* db, unsigned long long after, unsigned long long& last);
+    bool traceCall(int op, string_view model, int dealer, int value, bool used) const;
+    void traceCars(const vector<Car>& cars) const;
+    void traceResult(int result) const;
+    void traceResult(int result, int previous) const;
+    bool flushTrace() const;
     int getCap() const; 
 };
+
+// Thread-safe car database that partitions the keys by model hash into independent CarDB shards
+// Each shard has its own lock and its own incremental rehash
+// getCar takes no lock: it reads optimistically and validates against the shard's version counter,
+// and drained tables are only freed once no reader that could see them is still running
+class ConcurrentCarDB{
+    public:
+    friend class Grader;
+    friend class Tester;
+    ConcurrentCarDB(int shards, int size, hash_fn hash, prob_t probing);
+    ConcurrentCarDB(int shards, int size, hash_view_fn hash, prob_t probing);
+    ~ConcurrentCarDB();
+    bool insert(const Car& car);
+    bool remove(string_view model, int dealer);
+    // returns a copy since the bucket may change once the shard is unlocked
+    Car getCar(string_view model, int dealer) const;
+    bool updateQuantity(string_view model, int dealer, int quantity);
+    // upsert and adjustQuantity of CarDB, applied in place with the shard locked
+    bool upsert(Car car, int* previous = nullptr);
+    bool adjustQuantity(string_view model, int dealer, int delta, int* previous = nullptr);
+    // calls fn on every car of the dealer with its shard locked, returns the number of cars
+    int forEachCarOfDealer(int dealer, const function<void(const Car&)>& fn) const;
+    ModelTotals modelTotals(string_view model) const;
+    void useModelTotals(bool enabled);
+    void changeProbPolicy(prob_t policy);
+    int numShards() const;
+    // starts a thread that transfers bucketsPerStep old buckets of each migrating shard every intervalMicros,
+    // the writers then leave the migrations to it and only help one that falls behind
+    void startMigrationWorker(int bucketsPerStep = 4096, int intervalMicros = 50);
+    // stops the thread, the writers migrate inline again
+    void stopMigrationWorker();
+
+    private:
+    struct Retired{
+        Car* m_table;               // nullptr for models only
+        unsigned char* m_ctrl;
+        int m_capacity;
+        BucketKey* m_keys;
+        unsigned long long m_epoch; // reader epoch at the time the table was drained
+        vector<string> m_models;    // models taken out of the buckets by the same write
+    };
+    // A table of a shard as the lock-free readers see it, a write publishes it before it ends
+    struct TableView{
+        atomic<const unsigned char*> m_ctrl{nullptr}; // nullptr for an old table that does not exist
+        atomic<const BucketKey*> m_keys{nullptr};
+        atomic<int> m_capacity{0};
+        atomic<unsigned long long> m_magic{0};
+        atomic<prob_t> m_policy{NONE};
+    };
+    struct Shard{
+        alignas(64) mutable mutex m_lock; // kept on its own cache line
+        atomic<unsigned int> m_version;   // odd while a writer changes the shard
+        CarDB m_db;
+        vector<Retired> m_retired;        // drained tables waiting for the readers to leave
+        TableView m_current;              // the tables of m_db, as of the last write
+        TableView m_old;
+        atomic<int> m_oldCursor{0};
+        Shard(int size, hash_fn hash, prob_t probing) : m_version(0), m_db(size, hash, probing) {m_db.shareTables(); publishTables(*this);}
+        Shard(int size, hash_view_fn hash, prob_t probing) : m_version(0), m_db(size, hash, probing) {m_db.shareTables(); publishTables(*this);}
+        ~Shard();
+    };
+
+    hash_fn      m_hash;        // hash function
+    hash_view_fn m_viewHash;    // hash function taking a view, used instead of m_hash when set
+    unsigned int m_shardMask;   // number of shards minus one, the number of shards is a power of two
+    vector<unique_ptr<Shard>> m_shards;
+    thread       m_worker;      // background migration thread, not joinable when it is not running
+    atomic<bool> m_stopWorker;  // asks the background thread to return
+
+    Shard& shardOf(string_view model) const;
+    static int shardCount(int shards);
+    static void beginWrite(Shard& shard);
+    static void endWrite(Shard& shard);
+    static void publishTables(Shard& shard);
+    void migrationWorker(int bucketsPerStep, int intervalMicros);
+    bool tryRead(const Shard& shard, unsigned int version, unsigned int hash, string_view model, int dealer, int& quantity, bool& found) const;
+    static int findUnlocked(const Shard& shard, unsigned int version, const unsigned char* ctrl, const BucketKey* keys, int capacity, unsigned long long magic, prob_t policy, unsigned int hash, string_view model, int dealer);
+    static ReaderSlot* readerSlot();
+};
+
+// Read-only car database served straight from a file written by CarDB::saveSnapshot
+// The file is mapped into memory, so opening it costs the same for any number of cars
+// The snapshot must be opened with the hash function of the CarDB that saved it
+class CarSnapshot{
+    public:
+    friend class Grader;
+    friend class Tester;
+    friend class CarDB;
+    // returns nullptr if the file is missing, malformed, from another hash function,
+    // or, when verify is set, fails its checksum
+    static unique_ptr<CarSnapshot> open(const string& path, hash_fn hash, bool verify = false);
+    static unique_ptr<CarSnapshot> open(const string& path, hash_view_fn hash, bool verify = false);
+    ~CarSnapshot();
+    // returns EMPTY if not found
+    Car getCar(string_view model, int dealer) const;
+    int size() const;
+
+    private:
+    CarSnapshot() = default;
+    CarSnapshot(const CarSnapshot&) = delete;
+    CarSnapshot& operator=(const CarSnapshot&) = delete;
+
+    struct Record{
+        unsigned int m_modelOffset; // offset of the model in the string section
+        unsigned int m_modelLength;
+        int          m_quantity;
+        int          m_dealer;
+    };
+
+    hash_fn       m_hash = nullptr;     // hash function
+    hash_view_fn  m_viewHash = nullptr; // hash function taking a view, used instead of m_hash when set
+    void*         m_base = nullptr;     // start of the mapping
+    size_t        m_length = 0;         // length of the mapping
+    int           m_capacity = 0;
+    unsigned long long m_magic = 0;     // fastmod constant of m_capacity
+    int           m_count = 0;
+    const unsigned char* m_ctrl = nullptr;
+    const Record* m_records = nullptr;
+    const char*   m_strings = nullptr;
+    size_t        m_stringBytes = 0;
+    unsigned long long m_logSequence = 0; // last logged change the snapshot holds
+
+    static unique_ptr<CarSnapshot> map(const string& path, hash_fn hash, hash_view_fn viewHash, bool verify);
+    unsigned int hashKey(string_view model) const;
+};
 #endif
@@ -0,0 +1,25 @@
+// CMSC 341 - Fall 2023 - Project 4
+// Textbook model hashes shared by the tests, the benchmark and the replay driver
+#ifndef HASHCODE_H
+#define HASHCODE_H
+#include <string>
+#include <string_view>
+using namespace std;
+
+inline unsigned int hashCode(const string str) {
+   unsigned int val = 0 ;
+   const unsigned int thirtyThree = 33 ;  // magic number from textbook
+   for (unsigned int i = 0 ; i < str.length(); i++)
+      val = val * thirtyThree + str[i] ;
+   return val ;
+}
+
+// hashCode for a string_view, lookups with it never copy the model
+inline unsigned int hashCodeView(string_view str) {
+   unsigned int val = 0 ;
+   const unsigned int thirtyThree = 33 ;  // magic number from textbook
+   for (unsigned int i = 0 ; i < str.length(); i++)
+      val = val * thirtyThree + str[i] ;
+   return val ;
+}
+#endif
@@ -11,115 +11,22 @@
  ************************************************************************/
 
 #include "dealer.h"
+#include "hashcode.h"
+#include "random.h"
 #include <random>
 #include <vector>
 #include <algorithm>
-
-unsigned int hashCode(const string str);
+#include <thread>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
 
 string carModels[5] = {"challenger", "stratos", "gt500", "miura", "x101"};
 string dealers[5] = {"super car", "mega car", "car world", "car joint", "shack of cars"};
 
-enum RANDOM {UNIFORMINT, UNIFORMREAL, NORMAL, SHUFFLE};
-class Random {
-public:
-    Random(int min, int max, RANDOM type=UNIFORMINT, int mean=50, int stdev=20) : m_min(min), m_max(max), m_type(type)
-    {
-        if (type == NORMAL){
-            //the case of NORMAL to generate integer numbers with normal distribution
-            m_generator = std::mt19937(m_device());
-            //the data set will have the mean of 50 (default) and standard deviation of 20 (default)
-            //the mean and standard deviation can change by passing new values to constructor
-            m_normdist = std::normal_distribution<>(mean,stdev);
-        }
-        else if (type == UNIFORMINT) {
-            //the case of UNIFORMINT to generate integer numbers
-            // Using a fixed seed value generates always the same sequence
-            // of pseudorandom numbers, e.g. reproducing scientific experiments
-            // here it helps us with testing since the same sequence repeats
-            m_generator = std::mt19937(10);// 10 is the fixed seed value
-            m_unidist = std::uniform_int_distribution<>(min,max);
-        }
-        else if (type == UNIFORMREAL) { //the case of UNIFORMREAL to generate real numbers
-            m_generator = std::mt19937(10);// 10 is the fixed seed value
-            m_uniReal = std::uniform_real_distribution<double>((double)min,(double)max);
-        }
-        else { //the case of SHUFFLE to generate every number only once
-            m_generator = std::mt19937(m_device());
-        }
-    }
-    void setSeed(int seedNum){
-        // we have set a default value for seed in constructor
-        // we can change the seed by calling this function after constructor call
-        // this gives us more randomness
-        m_generator = std::mt19937(seedNum);
-    }
-
-    void getShuffle(vector<int> & array){
-        // the user program creates the vector param and passes here
-        // here we populate the vector using m_min and m_max
-        for (int i = m_min; i<=m_max; i++){
-            array.push_back(i);
-        }
-        shuffle(array.begin(),array.end(),m_generator);
-    }
-
-    void getShuffle(int array[]){
-        // the param array must be of the size (m_max-m_min+1)
-        // the user program creates the array and pass it here
-        vector<int> temp;
-        for (int i = m_min; i<=m_max; i++){
-            temp.push_back(i);
-        }
-        std::shuffle(temp.begin(), temp.end(), m_generator);
-        vector<int>::iterator it;
-        int i = 0;
-        for (it=temp.begin(); it != temp.end(); it++){
-            array[i] = *it;
-            i++;
-        }
-    }
-
-    int getRandNum(){
-        // this function returns integer numbers
-        // the object must have been initialized to generate integers
-        int result = 0;
-        if(m_type == NORMAL){
-            //returns a random number in a set with normal distribution
-            //we limit random numbers by the min and max values
-            result = m_min - 1;
-            while(result < m_min || result > m_max)
-                result = m_normdist(m_generator);
-        }
-        else if (m_type == UNIFORMINT){
-            //this will generate a random number between min and max values
-            result = m_unidist(m_generator);
-        }
-        return result;
-    }
-
-    double getRealRandNum(){
-        // this function returns real numbers
-        // the object must have been initialized to generate real numbers
-        double result = m_uniReal(m_generator);
-        // a trick to return numbers only with two deciaml points
-        // for example if result is 15.0378, function returns 15.03
-        // to round up we can use ceil function instead of floor
-        result = std::floor(result*100.0)/100.0;
-        return result;
-    }
-    
-    private:
-    int m_min;
-    int m_max;
-    RANDOM m_type;
-    std::random_device m_device;
-    std::mt19937 m_generator;
-    std::normal_distribution<> m_normdist;//normal distribution
-    std::uniform_int_distribution<> m_unidist;//integer uniform distribution
-    std::uniform_real_distribution<double> m_uniReal;//real uniform distribution
-
-};
 class Tester{
 public:
     
@@ -137,6 +44,49 @@ public:
         return (db.m_currentTable[indexOne].getModel() == car1.getModel() && db.m_currentTable[indexTwo].getModel() == car2.getModel());
     }
     
+    // testTableAllocator (prob_t policy)
+    // Case: Verify the tables of a CarDB come from the allocator given to its constructor through growth
+    // and migrations, and that every table goes back to it with the size it was allocated with
+    // Expected result: Return true if all data is found, several tables were allocated,
+    // and once the database is destroyed every byte was released, else false
+    bool testTableAllocator (prob_t policy) {
+        struct Counts{
+            int m_tables = 0;
+            long long m_bytes = 0;
+            int m_released = 0;
+        } counts;
+        TableAllocator allocator;
+        allocator.m_context = &counts;
+        allocator.m_allocate = [](void* context, size_t bytes) -> void* {
+            Counts* counts = static_cast<Counts*>(context);
+            counts->m_tables++;
+            counts->m_bytes += bytes;
+            return malloc(bytes);
+        };
+        allocator.m_release = [](void* context, void* buckets, size_t bytes) {
+            Counts* counts = static_cast<Counts*>(context);
+            counts->m_released++;
+            counts->m_bytes -= bytes;
+            free(buckets);
+        };
+        
+        bool result = true;
+        {
+            CarDB db(MINPRIME, hashCode, policy, allocator);
+            for (int i = 0; i < 2000; i++) {
+                db.insert(Car("Model" + to_string(i), i, MINID + i % 100, true));
+            }
+            for (int i = 0; i < 2000; i += 2) {
+                db.remove("Model" + to_string(i), MINID + i % 100);
+            }
+            for (int i = 0; result && i < 2000; i++) {
+                result = db.getCar("Model" + to_string(i), MINID + i % 100).getUsed() == (i % 2 == 1);
+            }
+            result = result && counts.m_tables > 2 && counts.m_bytes > 0;
+        }
+        return result && counts.m_released == counts.m_tables && counts.m_bytes == 0;
+    }
+    
     // testInsertionDataSize(CarDB& db, const vector<Car>& cars)
     // Case: Verify data size properly increases after insertion
     // Expected result: Returns true if the data size increases per the number of objects added, else false
@@ -405,113 +355,1608 @@ public:
 
         return rehashTriggeredByDeletedRatio;
     }
-};
-
-
-int main(){
-    
-    vector<Car> dataList;
-    Random RndID(MINID,MAXID);
-    Random RndCar(0,4);// selects one from the carModels array
-    Random RndQuantity(0,50);
-    CarDB cardb(MINPRIME, hashCode, DOUBLEHASH);
     
-    Tester tester;
-    CarDB dbOne (MINPRIME, hashCode, QUADRATIC);
-    Car car1 ("Model1", 10, 1001, true);
-    Car car2 ("Model2", 20, 1002, true);
-    Car invalidCar ("Model", 10, MAXID + 1, true);
+    // testGrowthBeyondMaxPrime (CarDB& db)
+    // Case: Verify the table keeps growing once the data outgrows MAXPRIME buckets
+    // Expected result: Return true if the capacity passes MAXPRIME, is a prime, and the data is retrievable,
+    // else false
+    bool testGrowthBeyondMaxPrime (CarDB& db) {
+        const int numCars = 60000;
+        
+        // Inserts enough data to need more than MAXPRIME buckets
+        for (int i = 0; i < numCars; i++){
+            Car car("Model" + to_string(i / 9), i, MINID + i % 9, true);
+            if (!db.insert(car)) {
+                return false;
+            }
+        }
+        
+        // Checks the capacity left the prime-by-prime range
+        if (db.getCap() <= MAXPRIME || !db.isPrime(db.getCap())) {
+            return false;
+        }
+        
+        // Checks every car is retrievable from either table
+        int found = 0;
+        for (int i = 0; i < numCars; i++){
+            Car car = db.getCar("Model" + to_string(i / 9), MINID + i % 9);
+            if (car.getUsed()) {
+                if (car.getQuantity() != i) {
+                    return false;
+                }
+                found++;
+            }
+        }
+        
+        return found == numCars;
+    }
     
-    if (tester.testInsertionCorrectBucket(dbOne, car1, car2)) {
-        cout << "Test - Correct Bucket is passed!" << endl;
+    // testViewLookup (CarDB& db)
+    // Case: Verify the string_view lookup and mutate API finds, updates and removes cars in place
+    // Expected result: Return true if findCar points into the table and the view overloads act on it,
+    // else false
+    bool testViewLookup (CarDB& db) {
+        string model = "a model name too long for small strings";
         
-    } else {
-        cout << "Test - Correct Bucket is failed!" << endl;
+        // Inserts by moving and by building in place
+        if (!db.insert(Car(model, 5, 1001, true)) || !db.emplace(model, 7, 1002)) {
+            return false;
+        }
+        
+        // Checks the pointer refers to the bucket in the table
+        const Car* car = db.findCar(string_view(model), 1001);
+        if (car == nullptr || car < db.m_currentTable || car >= db.m_currentTable + db.m_currentCap ||
+            car->getQuantity() != 5) {
+            return false;
+        }
+        
+        // Checks the missing cases
+        if (db.findCar(string_view(model), 1003) != nullptr || db.findCar("missing", 1001) != nullptr) {
+            return false;
+        }
+        
+        // Updates and removes through the view overloads
+        if (!db.updateQuantity(string_view(model), 1002, 9) || db.findCar(string_view(model), 1002)->getQuantity() != 9) {
+            return false;
+        }
+        if (!db.remove(string_view(model), 1001) || db.findCar(string_view(model), 1001) != nullptr) {
+            return false;
+        }
+        
+        return db.getCar(model, 1002).getQuantity() == 9;
     }
     
-    CarDB dbTwo (MINPRIME, hashCode, QUADRATIC);
-    for (int i = 0; i < 10; i++){
-        Car dataObj = Car(carModels[RndCar.getRandNum()], RndQuantity.getRandNum(),
-                          RndID.getRandNum(), true);
-        dataList.push_back(dataObj);
-        if (!dbTwo.insert(dataObj)) cout << "Did not insert " << dataObj << endl;
+    // testControlBytes (CarDB& db)
+    // Case: Verify the control bytes mirror the buckets after inserts, removals and a rehash
+    // Expected result: Return true if every live bucket carries its fingerprint and every free bucket is marked
+    // empty or deleted, else false
+    bool testControlBytes (CarDB& db) {
+        
+        // Inserts enough data to trigger a rehash, then removes some of it
+        for (int i = 0; i < 120; i++){
+            db.insert(Car("Model" + to_string(i), i, MINID + i, true));
+        }
+        for (int i = 0; i < 120; i += 3){
+            db.remove(Car("Model" + to_string(i), i, MINID + i, true));
+        }
+        
+        // Checks every bucket of the current table
+        for (int i = 0; i < db.m_currentCap; i++){
+            unsigned char ctrl = db.m_currentCtrl[i];
+            if (ctrl == CTRLEMPTY) {
+                continue; // an empty bucket holds no car
+            }
+            const Car& car = db.m_currentTable[i];
+            if (car.getUsed() ? ctrl != CarDB::fingerprint(hashCode(car.getModel())) : !(ctrl & CTRLEMPTY)) {
+                return false;
+            }
+        }
+        
+        return true;
     }
     
-    if (tester.testInsertionDataSize(dbTwo, dataList)) {
-        cout << "Test - Data Size Validation is passed!" << endl;
-    } else {
-        cout << "Test - Data Size Validation is failed!" << endl;
+    // testGroupedProbing (CarDB& db)
+    // Case: Verify the grouped policy finds colliding keys past the 0.5 load factor without a rehash
+    // Expected result: Return true if all live cars are found, removed cars are not, and the capacity is unchanged,
+    // else false
+    bool testGroupedProbing (CarDB& db) {
+        int initialCap = db.getCap();
+        const int numCars = 80;
+        
+        // Inserts colliding cars until the load factor passes 0.5
+        for (int i = 0; i < numCars; i++){
+            if (!db.insert(Car(carModels[i % 2], i, MINID + i, true))) {
+                return false;
+            }
+        }
+        if (db.getCap() != initialCap || db.lambda() <= 0.5) {
+            return false;
+        }
+        
+        // Removes every third car
+        for (int i = 0; i < numCars; i += 3){
+            if (!db.remove(carModels[i % 2], MINID + i)) {
+                return false;
+            }
+        }
+        
+        // Checks every lookup hits or misses as expected
+        for (int i = 0; i < numCars; i++){
+            const Car* car = db.findCar(carModels[i % 2], MINID + i);
+            if ((i % 3 == 0) != (car == nullptr) || (car && car->getQuantity() != i)) {
+                return false;
+            }
+        }
+        
+        return db.findCar(carModels[2], MINID) == nullptr;
     }
     
-    CarDB dbThree (MINPRIME, hashCode, QUADRATIC);
-    Car car4 ("Model4", 12, 1002, true);
-    if (tester.testGetCarNonExistent(dbThree)) {
-        cout << "Test - GetCar Error Case is passed!" << endl;
-    } else {
-        cout << "Test - GetCar Error Case is failed!" << endl;
+    // testMigrationBudget (CarDB& db)
+    // Case: Verify each incremental rehash step resumes at the cursor and visits at most the budget
+    // Expected result: Return true if the cursor advances by the budget, and all data is in the new table
+    // once the old table is released, else false
+    bool testMigrationBudget (CarDB& db) {
+        const int budget = 10;
+        db.setMigrationBudget(budget);
+        
+        // Inserts data until a rehash starts
+        int numCars = 0;
+        while (db.m_oldTable == nullptr) {
+            db.insert(Car("Model" + to_string(numCars), numCars, MINID + numCars % 1000, true));
+            numCars++;
+        }
+        
+        // Each insert performs one bounded step of the migration
+        while (db.m_oldTable != nullptr) {
+            int cursorBefore = db.m_oldCursor;
+            db.insert(Car("Model" + to_string(numCars), numCars, MINID + numCars % 1000, true));
+            numCars++;
+            if (db.m_oldTable != nullptr && db.m_oldCursor - cursorBefore != budget) {
+                return false;
+            }
+        }
+        
+        // Checks no data was left behind in the old table
+        for (int i = 0; i < numCars; i++){
+            if (db.getCar("Model" + to_string(i), MINID + i % 1000).getQuantity() != i) {
+                return false;
+            }
+        }
+        
+        return db.m_currentSize == numCars;
     }
     
-    CarDB dbFour (MINPRIME, hashCode, QUADRATIC);
-    if (tester.testGetCarNonColliding(dbFour)) {
-        cout << "Test - GetCar with several non-colliding keys is passed!" << endl;
-    } else {
-        cout << "Test - GetCar with several non-colliding keys is failed!" << endl;
+    // testConcurrentStress (ConcurrentCarDB& db)
+    // Case: Verify concurrent inserts, updates, removes and reads from several threads keep every shard consistent
+    // Expected result: Return true if every thread's final data is found with its last quantity, else false
+    bool testConcurrentStress (ConcurrentCarDB& db) {
+        const int numThreads = 8;
+        const int numCars = 2000;
+        vector<thread> workers;
+        
+        // Each thread owns its models, and reads the models of the next thread while they change
+        for (int t = 0; t < numThreads; t++){
+            workers.emplace_back([&db, t]() {
+                for (int i = 0; i < numCars; i++){
+                    db.insert(Car("Model" + to_string(t) + "_" + to_string(i), i, MINID + i % 1000, true));
+                }
+                for (int i = 0; i < numCars; i++){
+                    string model = "Model" + to_string(t) + "_" + to_string(i);
+                    if (i % 2 == 1) {
+                        db.remove(model, MINID + i % 1000);
+                    } else {
+                        db.updateQuantity(model, MINID + i % 1000, i + 1);
+                    }
+                    db.getCar("Model" + to_string((t + 1) % numThreads) + "_" + to_string(i), MINID + i % 1000);
+                }
+            });
+        }
+        for (auto& worker : workers){
+            worker.join();
+        }
+        
+        // Checks the final state of every thread's data
+        for (int t = 0; t < numThreads; t++){
+            for (int i = 0; i < numCars; i++){
+                Car car = db.getCar("Model" + to_string(t) + "_" + to_string(i), MINID + i % 1000);
+                if (i % 2 == 1 ? car.getUsed() : car.getQuantity() != i + 1) {
+                    return false;
+                }
+            }
+        }
+        
+        return true;
     }
     
-    CarDB dbFive (MINPRIME, hashCode, QUADRATIC);
-    if (tester.testFindOperationWithCollision(dbFive)) {
-        cout << "Test - GetCar with several colliding keys without triggering a rehash is passed!" << endl;
-    } else {
-        cout << "Test - GetCar with several colliding keys without triggering a rehash is failed!" << endl;
+    // testOptimisticReads (ConcurrentCarDB& db)
+    // Case: Verify lock-free reads always see the stable data while writers churn the shards through rehashes
+    // Expected result: Return true if no reader ever misses a stable car or sees a wrong quantity, else false
+    bool testOptimisticReads (ConcurrentCarDB& db) {
+        const int numStable = 500;
+        const int numChurn = 20000;
+        atomic<bool> done(false);
+        atomic<int> errors(0);
+        
+        // Inserts the data the readers check
+        for (int i = 0; i < numStable; i++){
+            db.insert(Car("Stable" + to_string(i), i, MINID + i, true));
+        }
+        
+        vector<thread> readers;
+        for (int t = 0; t < 4; t++){
+            readers.emplace_back([&]() {
+                while (!done.load()) {
+                    for (int i = 0; i < numStable; i++){
+                        Car car = db.getCar("Stable" + to_string(i), MINID + i);
+                        if (!car.getUsed() || car.getQuantity() != i) {
+                            errors++;
+                        }
+                    }
+                }
+            });
+        }
+        
+        // Inserts and removes other data so the shards keep rehashing
+        for (int i = 0; i < numChurn; i++){
+            db.insert(Car("Churn" + to_string(i), i, MINID + i % 1000, true));
+            if (i >= 100) {
+                db.remove("Churn" + to_string(i - 100), MINID + (i - 100) % 1000);
+            }
+        }
+        done = true;
+        for (auto& reader : readers){
+            reader.join();
+        }
+        
+        return errors == 0;
     }
     
-    if (tester.testRemoveNonCollidingKeys()){
-        cout << "Test - Remove non colliding keys is passed!" << endl;
-    } else {
-        cout << "Test - Remove non colliding keys is failed!" << endl;
+    // testOptimisticLongModels (ConcurrentCarDB& db)
+    // Case: Verify lock-free reads of models too long to be kept inside their bucket while writers remove them,
+    // reuse their buckets and shift Robin Hood runs, and that threads give their reader slot back when they exit
+    // Expected result: Return true if every read returns the right quantity and every short-lived thread
+    // gets a reader slot, else false
+    bool testOptimisticLongModels (ConcurrentCarDB& db) {
+        const string prefix = "AModelNameLongerThanAnyKeptInPlace";
+        const int numStable = 300;
+        const int numChurn = 20000;
+        const int numThreads = 600; // more than the reader slots, one after another
+        atomic<bool> done(false);
+        atomic<int> errors(0);
+        
+        // Inserts the data the readers check
+        for (int i = 0; i < numStable; i++){
+            db.insert(Car(prefix + "Stable" + to_string(i), i, MINID + i, true));
+        }
+        
+        // Readers also look up the churned cars, whose buckets the writer keeps freeing and reusing
+        vector<thread> readers;
+        for (int t = 0; t < 4; t++){
+            readers.emplace_back([&, t]() {
+                int next = t;
+                while (!done.load()) {
+                    for (int i = 0; i < numStable; i++){
+                        Car car = db.getCar(prefix + "Stable" + to_string(i), MINID + i);
+                        if (!car.getUsed() || car.getQuantity() != i) {
+                            errors++;
+                        }
+                        next = (next + 7) % numChurn;
+                        Car churned = db.getCar(prefix + "Churn" + to_string(next), MINID + next % 1000);
+                        if (churned.getUsed() && churned.getQuantity() != next) {
+                            errors++;
+                        }
+                    }
+                }
+            });
+        }
+        
+        // Inserts and removes other data so the shards keep rehashing, with Robin Hood for the second half
+        for (int i = 0; i < numChurn; i++){
+            db.insert(Car(prefix + "Churn" + to_string(i), i, MINID + i % 1000, true));
+            if (i >= 100) {
+                db.remove(prefix + "Churn" + to_string(i - 100), MINID + (i - 100) % 1000);
+            }
+            if (i == numChurn / 2) {
+                db.changeProbPolicy(ROBINHOOD);
+            }
+        }
+        done = true;
+        for (auto& reader : readers){
+            reader.join();
+        }
+        
+        bool slots = true;
+        for (int t = 0; t < numThreads; t++){
+            thread([&]() {
+                slots = slots && ConcurrentCarDB::readerSlot() != nullptr;
+            }).join();
+        }
+        
+        return errors == 0 && slots;
     }
     
-    if (tester.testRemoveCollidingKeys()){
-        cout << "Test - Remove colliding keys is passed!" << endl;
-    } else {
-        cout << "Test - Remove colliding keys is failed!" << endl;
+    // testOptimisticReadsUnderWrites (ConcurrentCarDB& db)
+    // Case: Verify lock-free reads while the writers take every path that changes a bucket: inserts and removals
+    // that rehash, updates, upserts and adjustments of the quantity, a background migration and a switch to
+    // Robin Hood, with models short enough for the reader copies and models read through their address
+    // The readers only touch atomics and published memory, so the test also runs clean under ThreadSanitizer:
+    // g++ -std=c++17 -g -O1 -fsanitize=thread dealer.cpp mytest.cpp
+    // Expected result: Return true if every read finds a quantity written for its car, else false
+    bool testOptimisticReadsUnderWrites (ConcurrentCarDB& db) {
+        const string longPrefix = "AModelNameLongerThanTheInlineWords";
+        const int numStable = 200;
+        const int numChurn = 10000;
+        atomic<bool> done(false);
+        atomic<int> errors(0);
+        auto modelOf = [&](int key) {
+            return (key % 2 ? longPrefix : string("Model")) + to_string(key);
+        };
+        
+        // Every quantity written for a stable car is its key modulo numStable
+        for (int i = 0; i < numStable; i++){
+            db.insert(Car(modelOf(i), i, MINID + i % 100, true));
+        }
+        db.startMigrationWorker(64, 20);
+        vector<thread> readers;
+        for (int t = 0; t < 3; t++){
+            readers.emplace_back([&]() {
+                while (!done.load()) {
+                    for (int i = 0; i < numStable; i++){
+                        Car car = db.getCar(modelOf(i), MINID + i % 100);
+                        if (!car.getUsed() || car.getQuantity() % numStable != i) {
+                            errors++;
+                        }
+                    }
+                }
+            });
+        }
+        
+        for (int step = 0; step < numChurn; step++){
+            int key = step % numStable;
+            int dealer = MINID + key % 100;
+            if (step % 3 == 0) {
+                db.updateQuantity(modelOf(key), dealer, key + numStable * step);
+            } else if (step % 3 == 1) {
+                db.upsert(Car(modelOf(key), key + numStable * step, dealer, true));
+            } else {
+                db.adjustQuantity(modelOf(key), dealer, numStable);
+            }
+            db.insert(Car(modelOf(numStable + step), step, MINID + step % 100, true));
+            if (step >= 50) {
+                db.remove(modelOf(numStable + step - 50), MINID + (step - 50) % 100);
+            }
+            if (step == numChurn / 2) {
+                db.changeProbPolicy(ROBINHOOD);
+            }
+        }
+        done = true;
+        for (auto& reader : readers){
+            reader.join();
+        }
+        db.stopMigrationWorker();
+        return errors == 0;
     }
     
-    CarDB dbSix (MINPRIME, hashCode, QUADRATIC);
-    if (tester.testRehashTriggering(dbSix)) {
-        cout << "Test - Rehash triggering during insertion is passed!" << endl;
-    } else {
-        cout << "Test - Rehash triggering during insertion is failed!" << endl;
+    // testInsertBatch (CarDB& db)
+    // Case: Verify a batch load resizes the table once and leaves no migration behind
+    // Expected result: Return true if only the valid cars are inserted, all data is found, and there is no old table,
+    // else false
+    bool testInsertBatch (CarDB& db) {
+        vector<Car> batch;
+        
+        // Inserts some data one by one first
+        for (int i = 0; i < 30; i++){
+            db.insert(Car("Single" + to_string(i), i, MINID + i, true));
+        }
+        
+        // Builds a batch with one invalid dealer in every ten cars
+        for (int i = 0; i < 300; i++){
+            batch.push_back(Car("Batch" + to_string(i), i, i % 10 == 0 ? MAXID + 1 : MINID + i, true));
+        }
+        if (db.insertBatch(batch) != 270 || db.m_oldTable != nullptr || db.lambda() > 0.5) {
+            return false;
+        }
+        
+        // Checks all the data is found
+        for (int i = 0; i < 30; i++){
+            if (db.getCar("Single" + to_string(i), MINID + i).getQuantity() != i) {
+                return false;
+            }
+        }
+        for (int i = 0; i < 300; i++){
+            const Car* car = db.findCar("Batch" + to_string(i), i % 10 == 0 ? MAXID + 1 : MINID + i);
+            if ((i % 10 == 0) != (car == nullptr) || (car && car->getQuantity() != i)) {
+                return false;
+            }
+        }
+        
+        return db.m_currentSize == 300;
     }
     
-    CarDB dbSeven (MINPRIME, hashCode, QUADRATIC);
-    if (tester.testRehashCompletion(dbSeven)) {
-        cout << "Test - Rehash completion after insertion is passed!" << endl;
-    } else {
-        cout << "Test - Rehash completion after insertion is failed!" << endl;
+    // testGetCars (CarDB& db)
+    // Case: Verify a batched lookup, including keys still in the old table during a rehash, matches findCar
+    // Expected result: Return true if every result of getCars is the pointer findCar returns, else false
+    bool testGetCars (CarDB& db) {
+        vector<string> models;
+        vector<pair<string_view, int>> keys;
+        vector<const Car*> results;
+        
+        // Inserts data until a rehash is in progress
+        int numCars = 0;
+        while (db.m_oldTable == nullptr) {
+            models.push_back("Model" + to_string(numCars));
+            db.insert(Car(models.back(), numCars, MINID + numCars, true));
+            numCars++;
+        }
+        
+        // Asks for every car plus one missing key each
+        for (int i = 0; i < numCars; i++){
+            keys.emplace_back(models[i], MINID + i);
+            keys.emplace_back(models[i], MAXID);
+        }
+        db.getCars(keys, results);
+        
+        if (results.size() != keys.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < keys.size(); i++){
+            if (results[i] != db.findCar(keys[i].first, keys[i].second) || (i % 2 == 0) != (results[i] != nullptr)) {
+                return false;
+            }
+        }
+        
+        return true;
     }
     
-    CarDB dbEight (MINPRIME, hashCode, QUADRATIC);
-    if (tester.testRehashTriggeringRemoval(dbEight)) {
-        cout << "Test - Rehash triggering during removal is passed!" << endl;
-    } else {
-        cout << "Test - Rehash triggering during removal is failed!" << endl;
+    // testSnapshot (CarDB& db)
+    // Case: Verify a snapshot saved during a rehash maps back with every live car, and rejects
+    // another hash function or a corrupted file
+    // Expected result: Return true if the mapped snapshot answers like the database and the bad opens fail,
+    // else false
+    bool testSnapshot (CarDB& db) {
+        const string path = "mytest_snapshot.bin";
+        
+        // Inserts data until a rehash is in progress, then removes some of it
+        int numCars = 0;
+        while (db.m_oldTable == nullptr) {
+            db.insert(Car("Model" + to_string(numCars), numCars, MINID + numCars, true));
+            numCars++;
+        }
+        for (int i = 0; i < numCars; i += 4){
+            db.remove("Model" + to_string(i), MINID + i);
+        }
+        if (!db.saveSnapshot(path)) {
+            return false;
+        }
+        
+        // Checks the mapped snapshot answers like the database
+        bool result = true;
+        unique_ptr<CarSnapshot> snapshot = CarSnapshot::open(path, hashCode, true);
+        if (!snapshot || snapshot->size() != numCars - (numCars + 3) / 4) {
+            result = false;
+        }
+        for (int i = 0; result && i < numCars; i++){
+            Car car = snapshot->getCar("Model" + to_string(i), MINID + i);
+            if (i % 4 == 0 ? car.getUsed() : car.getQuantity() != i) {
+                result = false;
+            }
+        }
+        snapshot.reset();
+        
+        // Opening with another hash function fails
+        if (CarSnapshot::open(path, [](string_view) {return 0u;})) {
+            result = false;
+        }
+        
+        // Flips the last byte of the model strings, only a verified open notices
+        fstream file(path, ios::in | ios::out | ios::binary);
+        file.seekg(-1, ios::end);
+        char last = file.get();
+        file.seekp(-1, ios::end);
+        file.put(last ^ 1);
+        file.close();
+        if (CarSnapshot::open(path, hashCode, true) || !CarSnapshot::open(path, hashCode, false)) {
+            result = false;
+        }
+        
+        remove(path.c_str());
+        return result;
     }
     
-    CarDB dbNine (MINPRIME, hashCode, QUADRATIC);
-    if (tester.testRehashCompletionRemoval(dbNine)) {
-        cout << "Test - Rehash completion after removal is passed!" << endl;
-    } else {
+    // testWriteAheadLog (CarDB& db)
+    // Case: Verify a database recovered from a checkpoint and the log written after it matches the logged one,
+    // and that a torn entry at the end of the log is dropped
+    // Expected result: Return true if the recovered database holds the same cars, else false
+    bool testWriteAheadLog (CarDB& db) {
+        const string snapshotPath = "mytest_wal.snap";
+        const string logPath = "mytest_wal.log";
+        remove(snapshotPath.c_str());
+        remove(logPath.c_str());
+        const int numCars = 500;
+        
+        // Half of the changes go to the snapshot, the other half only to the log
+        bool result = db.openLog(logPath, 64);
+        for (int i = 0; i < numCars / 2; i++){
+            db.insert(Car("Model" + to_string(i), i, MINID + i, true));
+        }
+        result = result && db.checkpoint(snapshotPath);
+        for (int i = numCars / 2; i < numCars; i++){
+            db.insert(Car("Model" + to_string(i), i, MINID + i, true));
+        }
+        for (int i = 0; i < numCars; i += 3){
+            db.updateQuantity("Model" + to_string(i), MINID + i, i + 1000);
+        }
+        for (int i = 0; i < numCars; i += 5){
+            db.remove("Model" + to_string(i), MINID + i);
+        }
+        result = result && db.syncLog();
+        
+        // Appends half an entry, as a crash in the middle of a write would
+        ofstream log(logPath, ios::binary | ios::app);
+        log.write("torn", 4);
+        log.close();
+        
+        CarDB recovered(MINPRIME, hashCode, QUADRATIC);
+        result = result && recovered.recover(snapshotPath, logPath);
+        for (int i = 0; result && i < numCars; i++){
+            Car expected = db.getCar("Model" + to_string(i), MINID + i);
+            Car car = recovered.getCar("Model" + to_string(i), MINID + i);
+            if (car.getUsed() != expected.getUsed() || car.getQuantity() != expected.getQuantity()) {
+                result = false;
+            }
+        }
+        
+        // New entries follow the last complete one, so a second recovery still reads them
+        result = result && recovered.openLog(logPath) && recovered.insert(Car("ModelNew", 1, MINID, true)) && recovered.syncLog();
+        CarDB again(MINPRIME, hashCode, QUADRATIC);
+        result = result && again.recover(snapshotPath, logPath) && again.getCar("ModelNew", MINID).getUsed() &&
+                 again.getCar("Model1", MINID + 1).getQuantity() == 1;
+        
+        remove(snapshotPath.c_str());
+        remove(logPath.c_str());
+        return result;
+    }
+    
+    // testLogReplay (CarDB& db)
+    // Case: Verify recovery brings back duplicate keys and changes the same copy of them as the logged database,
+    // applies the changes a snapshot already holds only once, syncs the changes left pending when traffic stops,
+    // and that a failed log write fails its change and the later ones until a checkpoint
+    // Expected result: Return true if every recovered database matches and the failure is reported, else false
+    bool testLogReplay (CarDB& db) {
+        const string snapshotPath = "mytest_replay.snap";
+        const string logPath = "mytest_replay.log";
+        const string timedPath = "mytest_replay_timed.log";
+        remove(snapshotPath.c_str());
+        remove(logPath.c_str());
+        remove(timedPath.c_str());
+        
+        // Returns the sorted quantities of the cars with the model at the dealer
+        auto quantities = [](const CarDB& from, const string& model, int dealer) {
+            vector<int> found;
+            from.forEachCarOfDealer(dealer, [&](const Car& car) {
+                if (car.getModel() == model) {
+                    found.push_back(car.getQuantity());
+                }
+            });
+            sort(found.begin(), found.end());
+            return found;
+        };
+        auto sameCars = [&](const CarDB& recovered) {
+            return quantities(recovered, "ModelA", MINID) == quantities(db, "ModelA", MINID) &&
+                   quantities(recovered, "ModelB", MINID) == quantities(db, "ModelB", MINID) &&
+                   quantities(recovered, "ModelC", MINID) == quantities(db, "ModelC", MINID);
+        };
+        
+        // Duplicates: the remove takes one copy, the updates change one copy each
+        bool result = db.openLog(logPath, 1);
+        db.insert(Car("ModelA", 3, MINID, true));
+        db.insert(Car("ModelA", 4, MINID, true));
+        result = result && db.remove("ModelA", MINID);
+        for (int quantity = 1; quantity <= 3; quantity++) {
+            db.insert(Car("ModelB", quantity, MINID, true));
+        }
+        result = result && db.updateQuantity("ModelB", MINID, 7) && db.updateQuantity("ModelB", MINID, 8) &&
+                 db.remove("ModelB", MINID) && quantities(db, "ModelA", MINID).size() == 1 &&
+                 quantities(db, "ModelB", MINID).size() == 2;
+        CarDB duplicates(MINPRIME, hashCode, QUADRATIC);
+        result = result && duplicates.recover(snapshotPath, logPath) && sameCars(duplicates);
+        
+        // A snapshot saved without emptying the log holds changes the log still has, they apply once
+        result = result && db.saveSnapshot(snapshotPath) && db.insert(Car("ModelC", 1, MINID, true));
+        CarDB overlap(MINPRIME, hashCode, GROUPED);
+        result = result && overlap.recover(snapshotPath, logPath) && sameCars(overlap);
+        
+        // A change left pending by a large group is synced by the timer once traffic stops
+        CarDB timed(MINPRIME, hashCode, QUADRATIC);
+        result = result && timed.openLog(timedPath, 1000, 5) && timed.insert(Car("ModelD", 1, MINID, true));
+        this_thread::sleep_for(chrono::milliseconds(100));
+        CarDB flushed(MINPRIME, hashCode, QUADRATIC);
+        result = result && flushed.recover("", timedPath) && flushed.getCar("ModelD", MINID).getUsed();
+        
+        // A log that cannot be written fails the change and refuses the later ones until a checkpoint
+        {
+            lock_guard<mutex> lock(db.m_logLock);
+            close(db.m_logFd);
+            db.m_logFd = ::open("/dev/null", O_RDONLY);
+        }
+        result = result && !db.insert(Car("ModelE", 1, MINID, true)) && db.logFailed() &&
+                 !db.insert(Car("ModelF", 1, MINID, true)) && !db.getCar("ModelF", MINID).getUsed() &&
+                 !db.updateQuantity("ModelC", MINID, 9) && !db.remove("ModelC", MINID) && !db.syncLog();
+        result = result && db.openLog(logPath, 1) && db.logFailed() && db.checkpoint(snapshotPath) && !db.logFailed() &&
+                 db.insert(Car("ModelF", 1, MINID, true));
+        CarDB restored(MINPRIME, hashCode, QUADRATIC);
+        result = result && restored.recover(snapshotPath, logPath) && sameCars(restored) &&
+                 restored.getCar("ModelE", MINID).getUsed() && restored.getCar("ModelF", MINID).getUsed();
+        
+        remove(snapshotPath.c_str());
+        remove(logPath.c_str());
+        remove(timedPath.c_str());
+        return result;
+    }
+    
+    // testDealerIndex (CarDB& db)
+    // Case: Verify the cars listed for each dealer match the live cars, while a rehash moves them
+    // between the tables and after some are removed
+    // Expected result: Return true if every dealer lists exactly its live cars, else false
+    bool testDealerIndex (CarDB& db) {
+        const int numDealers = 7;
+        
+        // Checks each dealer lists each of its live cars once
+        auto matches = [&](int numCars) {
+            for (int dealer = MINID; dealer < MINID + numDealers; dealer++) {
+                int expected = 0;
+                for (int i = dealer - MINID; i < numCars; i += numDealers) {
+                    expected += db.getCar("Model" + to_string(i), dealer).getUsed() ? 1 : 0;
+                }
+                int seen = 0;
+                bool valid = true;
+                int count = db.forEachCarOfDealer(dealer, [&](const Car& car) {
+                    seen++;
+                    valid = valid && car.getUsed() && car.getDealer() == dealer &&
+                            db.getCar(car.getModel(), dealer).getQuantity() == car.getQuantity();
+                });
+                if (!valid || seen != count || count != expected) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        
+        // Inserts until a rehash is in progress, then removes every third car during the migration
+        int numCars = 0;
+        while (db.m_oldTable == nullptr) {
+            db.insert(Car("Model" + to_string(numCars), numCars, MINID + numCars % numDealers, true));
+            numCars++;
+        }
+        bool result = matches(numCars);
+        for (int i = 0; i < numCars; i += 3){
+            db.remove("Model" + to_string(i), MINID + i % numDealers);
+        }
+        result = result && matches(numCars);
+        
+        // Finishes the migration with more inserts
+        for (int i = 0; i < 50; i++, numCars++){
+            db.insert(Car("Model" + to_string(numCars), numCars, MINID + numCars % numDealers, true));
+        }
+        result = result && db.m_oldTable == nullptr && matches(numCars);
+        
+        // A dealer without cars and an invalid one list nothing
+        result = result && db.forEachCarOfDealer(MAXID, [](const Car&) {}) == 0 && db.forEachCarOfDealer(0, [](const Car&) {}) == 0;
+        return result;
+    }
+    
+    // testModelTotals (CarDB& db)
+    // Case: Verify the totals of each model are built from the stored cars when enabled,
+    // then follow inserts, updates and removals across a rehash
+    // Expected result: Return true if every model's totals match a sum over its cars, else false
+    bool testModelTotals (CarDB& db) {
+        const int numModels = 5;
+        const int numDealers = 60;
+        
+        // Checks the totals of each model against its cars
+        auto matches = [&]() {
+            for (int model = 0; model < numModels; model++) {
+                long long quantity = 0;
+                int dealers = 0;
+                for (int dealer = MINID; dealer < MINID + numDealers; dealer++) {
+                    Car car = db.getCar("Model" + to_string(model), dealer);
+                    if (car.getUsed()) {
+                        quantity += car.getQuantity();
+                        dealers++;
+                    }
+                }
+                ModelTotals totals = db.modelTotals("Model" + to_string(model));
+                if (totals.m_quantity != quantity || totals.m_dealers != dealers) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        
+        // Inserts every model for every dealer, which rehashes the table, half of them before the totals are kept
+        for (int dealer = MINID; dealer < MINID + numDealers; dealer++) {
+            if (dealer == MINID + numDealers / 2) {
+                if (db.modelTotals("Model0").m_dealers != 0) return false;
+                db.useModelTotals(true);
+            }
+            for (int model = 0; model < numModels; model++) {
+                db.insert(Car("Model" + to_string(model), dealer % 17, dealer, true));
+            }
+        }
+        bool result = matches();
+        
+        // Updates and removes some of the cars
+        for (int dealer = MINID; dealer < MINID + numDealers; dealer += 2) {
+            db.updateQuantity("Model1", dealer, 100);
+            db.remove("Model2", dealer);
+        }
+        result = result && matches();
+        
+        // A model whose cars are all removed has no totals
+        for (int dealer = MINID; dealer < MINID + numDealers; dealer++) {
+            db.remove("Model4", dealer);
+        }
+        ModelTotals removed = db.modelTotals("Model4");
+        result = result && matches() && removed.m_quantity == 0 && removed.m_dealers == 0;
+        db.useModelTotals(false);
+        return result && db.m_modelTotals.empty() && db.modelTotals("Model0").m_dealers == 0;
+    }
+    
+    // testMigrationLookup (CarDB& db)
+    // Case: Verify every car is found and updated at several points of a migration, whichever table
+    // the lookup probes first
+    // Expected result: Return true if every lookup and update succeeds on both sides of the cursor, else false
+    bool testMigrationLookup (CarDB& db) {
+        
+        // Starts a migration that no later call advances on its own
+        db.setMigrationBudget(1);
+        int numCars = 0;
+        while (db.m_oldTable == nullptr) {
+            db.insert(Car("Model" + to_string(numCars), numCars, MINID + numCars % 100, true));
+            numCars++;
+        }
+        
+        // Moves the cursor forward a seventh of the old table at a time
+        bool result = true;
+        int round = 0;
+        while (result) {
+            round++;
+            for (int i = 0; result && i < numCars; i++){
+                string model = "Model" + to_string(i);
+                if (!db.updateQuantity(model, MINID + i % 100, i + round) || db.getCar(model, MINID + i % 100).getQuantity() != i + round) {
+                    result = false;
+                }
+            }
+            if (db.m_oldTable == nullptr) {
+                break;
+            }
+            db.migrate((db.m_oldCap + 6) / 7);
+        }
+        return result && round > 2;
+    }
+    
+    // testMigrationFull (CarDB& db)
+    // Case: Verify a migration into a current table with no free bucket keeps the car it cannot move in the old
+    // table, with its dealer list entry and model totals, and finishes once buckets are freed
+    // Expected result: Return true if migrate reports the full table, no car is lost, and the migration then ends, else false
+    bool testMigrationFull (CarDB& db) {
+        const int numCars = 40;
+        db.useModelTotals(true);
+        for (int i = 0; i < numCars; i++) {
+            db.insert(Car("Model" + to_string(i), i, MINID + i % 10, true));
+        }
+        
+        // Starts a migration by hand and fills the new table before any car moves
+        db.startMigration(MINPRIME);
+        int fillers = 0;
+        for (;;) {
+            string model = "Filler" + to_string(fillers);
+            int index = db.placeCar(Car(model, 1, MAXID, true), db.hashKey(model));
+            if (index == -1) {
+                break;
+            }
+            db.indexAdd(index);
+            fillers++;
+        }
+        auto allFound = [&]() {
+            int listed = 0;
+            for (int i = 0; i < numCars; i++) {
+                if (db.getCar("Model" + to_string(i), MINID + i % 10).getQuantity() != i ||
+                    db.modelTotals("Model" + to_string(i)).m_quantity != i) {
+                    return false;
+                }
+            }
+            for (int dealer = MINID; dealer < MINID + 10; dealer++) {
+                listed += db.forEachCarOfDealer(dealer, [](const Car&) {});
+            }
+            return listed == numCars;
+        };
+        bool result = !db.migrate(db.m_oldCap) && db.m_oldTable != nullptr && allFound();
+        
+        // Frees buckets, then the rest of the migration goes through
+        for (int i = 0; result && i < fillers; i++) {
+            result = db.remove("Filler" + to_string(i), MAXID);
+        }
+        while (result && db.m_oldTable) {
+            result = db.migrate(db.m_oldCap);
+        }
+        return result && allFound() && db.insertBatch({Car("Model" + to_string(numCars), 1, MINID, true)}) == 1;
+    }
+    
+    // testWyHash (CarDB& db)
+    // Case: Verify the built-in wyHash spreads short models over the fingerprints and works as the hash of a table
+    // Expected result: Return true if short models get many fingerprints and every car is found, else false
+    bool testWyHash (CarDB& db) {
+        
+        // The textbook hash leaves the top bits of a short model at zero, wyHash does not
+        bool seen[128] = {false};
+        int fingerprints = 0;
+        for (int i = 0; i < 1000; i++){
+            unsigned int tag = wyHash(to_string(i)) >> 25;
+            fingerprints += seen[tag] ? 0 : 1;
+            seen[tag] = true;
+        }
+        if (fingerprints < 120 || wyHash("Model") != wyHash(string_view("Model X", 5)) || wyHash("Model") == wyHash("Modem")) {
+            return false;
+        }
+        
+        for (int i = 0; i < 1000; i++){
+            db.insert(Car(to_string(i), i, MINID + i % 10, true));
+        }
+        for (int i = 0; i < 1000; i++){
+            if (db.getCar(to_string(i), MINID + i % 10).getQuantity() != i) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    // testProbeSequence (prob_t policy)
+    // Case: Verify cars colliding on one model fill the buckets of probeIndex in order, and are found there
+    // Expected result: Return true if the i-th colliding car sits at the i-th bucket of the probe sequence, else false
+    bool testProbeSequence (prob_t policy) {
+        CarDB db(MINPRIME, hashCode, policy);
+        unsigned int hash = hashCode("Collide");
+        
+        // Stays under the load factor that would rehash the table
+        for (int i = 0; i < 45; i++){
+            db.insert(Car("Collide", i, MINID + i, true));
+        }
+        for (int i = 0; i < 45; i++){
+            unsigned int index = db.probeIndex(hash, i, db.m_currentCap, policy);
+            if (db.m_currentTable[index].getDealer() != MINID + i || db.findCar("Collide", MINID + i) != &db.m_currentTable[index]) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    // testRobinHood (CarDB& db)
+    // Case: Verify Robin Hood removals leave no deleted buckets under insert and remove churn, including a switch
+    // to Robin Hood in the middle of the churn, while every car stays findable and listed for its dealer
+    // Expected result: Return true if the distances and contents stay consistent and nothing is deleted, else false
+    bool testRobinHood (CarDB& db) {
+        const int numKeys = 400;
+        vector<bool> live(numKeys, false);
+        Random rnd(0, numKeys - 1);
+        
+        // Checks every distance against the home bucket, the Robin Hood order within a run, and the contents
+        auto consistent = [&]() {
+            if (db.m_currProbing == ROBINHOOD) {
+                if (db.m_currNumDeleted != 0) {
+                    return false;
+                }
+                for (int i = 0; i < db.m_currentCap; i++) {
+                    if (db.m_currentCtrl[i] & CTRLEMPTY) {
+                        if (db.m_currentCtrl[i] != CTRLEMPTY) {
+                            return false;
+                        }
+                        continue;
+                    }
+                    unsigned int home = hashCode(db.m_currentTable[i].getModel()) % db.m_currentCap;
+                    unsigned int distance = (i + db.m_currentCap - home) % db.m_currentCap;
+                    int next = (i + 1) % db.m_currentCap;
+                    if (db.m_currentDist[i] != distance ||
+                        (!(db.m_currentCtrl[next] & CTRLEMPTY) && db.m_currentDist[next] > distance + 1)) {
+                        return false;
+                    }
+                }
+            }
+            int listed = 0;
+            for (int i = 0; i < numKeys; i++) {
+                if (db.getCar("Model" + to_string(i), MINID + i % 10).getUsed() != live[i]) {
+                    return false;
+                }
+            }
+            for (int dealer = MINID; dealer < MINID + 10; dealer++) {
+                listed += db.forEachCarOfDealer(dealer, [](const Car&) {});
+            }
+            return listed == count(live.begin(), live.end(), true);
+        };
+        
+        // Churns with quadratic probing, switches to Robin Hood, and keeps churning through its rehashes
+        bool result = true;
+        for (int step = 0; result && step < 6000; step++) {
+            if (step == 1000) {
+                db.changeProbPolicy(ROBINHOOD);
+            }
+            int key = rnd.getRandNum();
+            if (live[key]) {
+                live[key] = !db.remove("Model" + to_string(key), MINID + key % 10);
+            } else {
+                live[key] = db.insert(Car("Model" + to_string(key), key, MINID + key % 10, true));
+            }
+            if (step % 250 == 0) {
+                result = consistent();
+            }
+        }
+        return result && db.m_currProbing == ROBINHOOD && consistent();
+    }
+    
+    // testRobinHoodPlacement (CarDB& db)
+    // Case: Verify a car inserted with m_used false into a Robin Hood table, by insert, insertBatch or
+    // adjustQuantity, reads back as used after it displaced a resident, and that a full table refuses a car
+    // without changing the car or the table
+    // Expected result: Return true if every stored car is used and the full table is left as it was, else false
+    bool testRobinHoodPlacement (CarDB& db) {
+        const int numKeys = 60; // below the Robin Hood load factor of the first table, so no rehash moves them
+        vector<const Car*> where(numKeys, nullptr);
+        bool displaced = false;
+        for (int i = 0; i < numKeys; i++) {
+            if (!db.insert(Car("Model" + to_string(i), i, MINID + i % 10))) {
+                return false;
+            }
+            for (int j = 0; j < i; j++) {
+                const Car* car = db.findCar("Model" + to_string(j), MINID + j % 10);
+                displaced = displaced || car != where[j];
+                where[j] = car;
+            }
+            where[i] = db.findCar("Model" + to_string(i), MINID + i % 10);
+        }
+        vector<Car> batch;
+        for (int i = numKeys; i < numKeys + 20; i++) {
+            batch.push_back(Car("Model" + to_string(i), i, MINID + i % 10));
+        }
+        bool result = displaced && db.insertBatch(batch) == 20 &&
+                      db.adjustQuantity("Model" + to_string(numKeys + 20), MINID, 5);
+        for (int i = 0; result && i <= numKeys + 20; i++) {
+            result = db.getCar("Model" + to_string(i), MINID + (i < numKeys + 20 ? i % 10 : 0)).getUsed();
+        }
+        for (int i = 0; result && i < db.m_currentCap; i++) {
+            result = (db.m_currentCtrl[i] & CTRLEMPTY) || db.m_currentTable[i].getUsed();
+        }
+        
+        // Fills a table without the rehash of insert, then offers one car more
+        CarDB full(MINPRIME, hashCode, ROBINHOOD);
+        for (int i = 0; result && i < full.m_currentCap; i++) {
+            string model = "Model" + to_string(i);
+            int index = full.placeCar(Car(model, i, MINID + i % 10), full.hashKey(model));
+            result = index != -1;
+            if (result) {
+                full.indexAdd(index);
+            }
+        }
+        Car extra("Extra", 1, MINID, true);
+        result = result && full.placeCar(std::move(extra), full.hashKey("Extra")) == -1 && extra.getModel() == "Extra" &&
+                 full.m_currentSize == full.m_currentCap;
+        for (int i = 0; result && i < full.m_currentCap; i++) {
+            result = full.getCar("Model" + to_string(i), MINID + i % 10).getQuantity() == i;
+        }
+        return result;
+    }
+    
+    // testStats (CarDB& db)
+    // Case: Verify stats() counts the operations and probes when built with CARDB_STATS, and stays zero otherwise,
+    // while the table fields and the JSON dump always describe the tables
+    bool testStats (CarDB& db) {
+        const int numCars = 300;
+        for (int i = 0; i < numCars; i++){
+            db.insert(Car("Model" + to_string(i), i, MINID + i % 10, true));
+        }
+        for (int i = 0; i < 50; i++){
+            db.remove("Model" + to_string(i), MINID + i % 10);
+        }
+        for (int i = 0; i < numCars; i++){
+            db.getCar("Model" + to_string(i), MINID + i % 10);
+        }
+        db.updateQuantity("Model100", MINID, 7);
+        db.updateQuantity("Model0", MINID, 7);
+        
+        CarDBStats stats = db.stats();
+        if (stats.m_capacity != db.m_currentCap || stats.m_live + stats.m_oldLive != numCars - 50 ||
+            stats.m_deleted != db.m_currNumDeleted) {
+            return false;
+        }
+        
+        long long histogram = 0;
+        for (int i = 0; i < PROBEBUCKETS; i++){
+            histogram += stats.m_probes.m_counts[i];
+        }
+        if (STATSENABLED) {
+            if (stats.m_inserts != numCars || stats.m_insertFailures != 0 || stats.m_removes != 50 ||
+                stats.m_removeMisses != 0 || stats.m_updates != 1 || stats.m_updateMisses != 1 ||
+                stats.m_lookups != numCars + 2 || stats.m_lookupMisses != 51 || histogram != stats.m_lookups ||
+                stats.m_probes.m_probes < stats.m_lookups || stats.m_probes.m_max < 1 ||
+                stats.m_migrations < 1 || stats.m_rehashSteps < stats.m_migrations || stats.m_rehashNanos <= 0) {
+                return false;
+            }
+        } else if (stats.m_inserts != 0 || stats.m_lookups != 0 || histogram != 0 || stats.m_rehashSteps != 0) {
+            return false;
+        }
+        
+        // The dump is one JSON object on one line
+        ostringstream out;
+        db.dumpStats(out);
+        string json = out.str();
+        return json.front() == '{' && json.find("}\n") == json.size() - 2 &&
+               json.find("\"inserts\":" + to_string(stats.m_inserts) + ",") != string::npos &&
+               json.find("\"capacity\":" + to_string(stats.m_capacity) + ",") != string::npos;
+    }
+    
+    // testNegativeLookup (CarDB& db)
+    // Case: Verify misses stop at a never used bucket without losing the cars past a deleted one,
+    // and the Bloom filters answer the same as the tables through migrations and removals
+    bool testNegativeLookup (CarDB& db) {
+        const int numCars = 500;
+        
+        // A chain of one model, its deleted buckets must not end the search
+        for (int i = 0; i < 20; i++){
+            db.insert(Car("ModelA", i, MINID + i, true));
+        }
+        for (int i = 0; i < 20; i += 2){
+            db.remove("ModelA", MINID + i);
+        }
+        
+        // The filter is built from the stored cars, then follows the inserts and migrations
+        db.useFilter(true);
+        for (int i = 0; i < numCars; i++){
+            db.insert(Car("Model" + to_string(i), i, MINID + i % 10, true));
+        }
+        for (int i = 0; i < numCars; i += 3){
+            db.remove("Model" + to_string(i), MINID + i % 10);
+        }
+        
+        auto consistent = [&]() {
+            for (int i = 0; i < 20; i++){
+                const Car* car = db.findCar("ModelA", MINID + i);
+                if (i % 2 == 0 ? car != nullptr : car == nullptr || car->getQuantity() != i) {
+                    return false;
+                }
+            }
+            for (int i = 0; i < numCars; i++){
+                const Car* car = db.findCar("Model" + to_string(i), MINID + i % 10);
+                if (i % 3 == 0 ? car != nullptr : car == nullptr || car->getQuantity() != i) {
+                    return false;
+                }
+                if (db.findCar("Model" + to_string(i), MINID + i % 10 + 1) != nullptr) {
+                    return false;
+                }
+            }
+            return db.getCar("nonexistent model", 1234) == EMPTY;
+        };
+        
+        bool result = db.m_currentFilter != nullptr && consistent();
+        db.useFilter(false);
+        return result && db.m_currentFilter == nullptr && db.m_oldFilter == nullptr && consistent();
+    }
+    
+    // testUpsert (CarDB& db)
+    // Case: Verify upsert and adjustQuantity never duplicate a car and report the previous quantity,
+    // keeping the dealer index and the model totals in step through migrations and changes of policy
+    // A previous quantity of -1 is a stock that went negative, not a failure
+    bool testUpsert (CarDB& db) {
+        db.useModelTotals(true);
+        int previous[7];
+        if (!db.upsert(Car("ModelX", 5, MINID, true), &previous[0]) || !db.upsert(Car("ModelX", 8, MINID, true), &previous[1]) ||
+            !db.adjustQuantity("ModelX", MINID, 4, &previous[2]) || !db.adjustQuantity("ModelY", MINID, 3, &previous[3]) ||
+            db.upsert(Car("ModelX", 1, MAXID + 1, true)) || db.adjustQuantity("ModelX", MINID - 1, 1) ||
+            !db.adjustQuantity("ModelZ", MINID, -1, &previous[4]) || !db.adjustQuantity("ModelZ", MINID, 5, &previous[5]) ||
+            !db.upsert(Car("ModelZ", 0, MINID, true), &previous[6])) {
+            return false;
+        }
+        if (previous[0] != 0 || previous[1] != 5 || previous[2] != 8 || previous[3] != 0 || previous[4] != 0 ||
+            previous[5] != -1 || previous[6] != 4 ||
+            db.getCar("ModelX", MINID).getQuantity() != 12 || db.getCar("ModelY", MINID).getQuantity() != 3 ||
+            db.forEachCarOfDealer(MINID, [](const Car&) {}) != 3 || db.modelTotals("ModelX").m_dealers != 1) {
+            return false;
+        }
+        db.remove("ModelX", MINID);
+        db.remove("ModelY", MINID);
+        db.remove("ModelZ", MINID);
+        
+        // Random upserts, adjustments and removals against a reference, the policy changes twice on the way
+        const int numKeys = 300;
+        vector<int> quantity(numKeys, -1);
+        Random rnd(0, numKeys - 1);
+        for (int step = 0; step < 6000; step++){
+            if (step == 2000) db.changeProbPolicy(GROUPED);
+            if (step == 4000) db.changeProbPolicy(ROBINHOOD);
+            int key = rnd.getRandNum();
+            string model = "Model" + to_string(key % 30);
+            int dealer = MINID + key;
+            int expected = quantity[key] == -1 ? 0 : quantity[key];
+            int previous = -1;
+            if (step % 3 == 0) {
+                if (!db.upsert(Car(model, step, dealer, true), &previous) || previous != expected) return false;
+                quantity[key] = step;
+            } else if (step % 3 == 1) {
+                if (!db.adjustQuantity(model, dealer, key, &previous) || previous != expected) return false;
+                quantity[key] = expected + key;
+            } else if (quantity[key] != -1) {
+                db.remove(model, dealer);
+                quantity[key] = -1;
+            }
+        }
+        
+        // Checks every key once, and the totals of every model
+        vector<long long> totals(30, 0);
+        vector<int> dealers(30, 0);
+        for (int key = 0; key < numKeys; key++){
+            const Car* car = db.findCar("Model" + to_string(key % 30), MINID + key);
+            if (quantity[key] == -1 ? car != nullptr : car == nullptr || car->getQuantity() != quantity[key] ||
+                db.forEachCarOfDealer(MINID + key, [](const Car&) {}) != 1) {
+                return false;
+            }
+            if (quantity[key] != -1) {
+                totals[key % 30] += quantity[key];
+                dealers[key % 30]++;
+            }
+        }
+        for (int model = 0; model < 30; model++){
+            ModelTotals modelTotals = db.modelTotals("Model" + to_string(model));
+            if (modelTotals.m_quantity != totals[model] || modelTotals.m_dealers != dealers[model]) {
+                return false;
+            }
+        }
+        return db.m_currProbing == ROBINHOOD;
+    }
+    
+    // testConcurrentAdjust (ConcurrentCarDB& db)
+    // Case: Verify concurrent adjustments of the same cars are never lost
+    bool testConcurrentAdjust (ConcurrentCarDB& db) {
+        const int numThreads = 4;
+        const int numAdjusts = 5000;
+        const int numCars = 50;
+        vector<thread> workers;
+        for (int t = 0; t < numThreads; t++){
+            workers.emplace_back([&db]() {
+                for (int i = 0; i < numAdjusts; i++){
+                    db.adjustQuantity("Model" + to_string(i % numCars), MINID + i % numCars, 1);
+                }
+            });
+        }
+        for (auto& worker : workers){
+            worker.join();
+        }
+        
+        for (int i = 0; i < numCars; i++){
+            if (db.getCar("Model" + to_string(i), MINID + i).getQuantity() != numThreads * numAdjusts / numCars) {
+                return false;
+            }
+        }
+        int previous = 0;
+        return db.upsert(Car("Model0", 1, MINID, true), &previous) && previous == numThreads * numAdjusts / numCars;
+    }
+    
+    // testMigrationWorker (ConcurrentCarDB& db)
+    // Case: Verify the background worker drains the migrations without any foreground call,
+    // and no car is lost while writers and the worker share the shards
+    bool testMigrationWorker (ConcurrentCarDB& db) {
+        const int numCars = 20000;
+        db.startMigrationWorker(512, 10);
+        thread writer([&db]() {
+            for (int i = 0; i < numCars; i++){
+                db.insert(Car("Model" + to_string(i), i, MINID + i % 1000, true));
+                if (i % 3 == 0) {
+                    db.adjustQuantity("Model" + to_string(i / 2), MINID + i / 2 % 1000, 0);
+                }
+            }
+        });
+        bool result = true;
+        for (int i = 0; i < numCars; i += 7){
+            Car car = db.getCar("Model" + to_string(i), MINID + i % 1000);
+            result = result && (!car.getUsed() || car.getQuantity() == i);
+        }
+        writer.join();
+        
+        // Waits up to two seconds for the worker alone to finish the migrations
+        auto migrating = [&db]() {
+            for (auto& shard : db.m_shards){
+                lock_guard<mutex> lock(shard->m_lock);
+                if (shard->m_db.m_oldTable) return true;
+            }
+            return false;
+        };
+        for (int wait = 0; wait < 200 && migrating(); wait++){
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+        result = result && !migrating() && db.m_shards[0]->m_db.m_backgroundMigration;
+        db.stopMigrationWorker();
+        
+        for (int i = 0; i < numCars; i++){
+            if (db.getCar("Model" + to_string(i), MINID + i % 1000).getQuantity() != i) {
+                return false;
+            }
+        }
+        for (auto& shard : db.m_shards){
+            if (shard->m_db.m_backgroundMigration) return false;
+        }
+        return result;
+    }
+    
+    // testTrace (CarDB& db)
+    // Case: Verify a trace holds the stored cars and every later call, drops a record cut off at its end,
+    // and replays to the same results and cars under the recorded and another policy
+    // Expected result: Return true if both replays match the traced database call by call, else false
+    bool testTrace (CarDB& db) {
+        const string tracePath = "mytest_trace.bin";
+        const int numCars = 300;
+        for (int i = 0; i < 100; i++){
+            db.insert(Car("Model" + to_string(i), i, MINID + i % 10, true));
+        }
+        bool result = db.startTrace(tracePath);
+        int calls = 0;
+        for (int i = 100; i < numCars; i++, calls++){
+            db.insert(Car("Model" + to_string(i), i, MINID + i % 10, true));
+        }
+        for (int i = 0; i < numCars; i += 2, calls++){
+            db.getCar("Model" + to_string(i), MINID + i % 10 + (i % 4 == 0 ? 0 : 1));
+        }
+        for (int i = 0; i < numCars; i += 3, calls += 2){
+            db.updateQuantity("Model" + to_string(i), MINID + i % 10, i + 1000);
+            db.adjustQuantity("Model" + to_string(i + 1), MINID + (i + 1) % 10, -1);
+        }
+        db.changeProbPolicy(GROUPED);
+        for (int i = 0; i < numCars; i += 5, calls += 2){
+            db.remove("Model" + to_string(i), MINID + i % 10);
+            db.upsert(Car("Model" + to_string(i + numCars), i, MINID + i % 10, true));
+        }
+        db.insertBatch({Car("BatchA", 1, MINID, true), Car("BatchB", 2, MAXID + 1, true)});
+        db.insert(Car("Bad", 1, MAXID + 1, true));
+        db.insert(Car("Negative", -1, MINID, true));
+        db.getCar("Negative", MINID);
+        db.getCar("Missing", MINID);
+        calls += 6;
+        result = result && db.stopTrace() && !db.stopTrace();
+        
+        // Appends half a record, as a crash in the middle of a write would
+        ofstream trace(tracePath, ios::binary | ios::app);
+        trace.put(TRACEINSERT);
+        trace.close();
+        
+        TraceInfo info;
+        vector<TraceRecord> records;
+        result = result && CarDB::loadTrace(tracePath, info, records) && info.m_policy == QUADRATIC &&
+                 static_cast<int>(records.size()) == calls + 1 && records[0].m_op == TRACEBATCH &&
+                 records[0].m_cars.size() == 100 && records[0].m_result == 100;
+        for (size_t i = 1; result && i < records.size(); i++){
+            result = records[i].m_nanos >= records[i - 1].m_nanos;
+        }
+        
+        // A car holding -1 is found, unlike a missing one
+        size_t last = records.size() - 1;
+        result = result && records[last - 1].m_found && records[last - 1].m_result == -1 &&
+                 !records[last].m_found && records[last].m_result == 0;
+        for (prob_t policy : {info.m_policy, ROBINHOOD}){
+            CarDB replay(info.m_capacity, hashCode, policy);
+            for (const TraceRecord& record : records){
+                int previous = 0;
+                bool found = false;
+                if (replay.replayCall(record, &previous, &found) != record.m_result || previous != record.m_previous ||
+                    found != record.m_found) {
+                    result = false;
+                }
+            }
+            for (int i = 0; result && i < 2 * numCars; i++){
+                Car expected = db.getCar("Model" + to_string(i), MINID + i % 10);
+                Car car = replay.getCar("Model" + to_string(i), MINID + i % 10);
+                result = car.getUsed() == expected.getUsed() && car.getQuantity() == expected.getQuantity();
+            }
+        }
+        
+        remove(tracePath.c_str());
+        return result && !CarDB::loadTrace(tracePath, info, records);
+    }
+};
+
+
+int main(){
+    
+    vector<Car> dataList;
+    Random RndID(MINID,MAXID);
+    Random RndCar(0,4);// selects one from the carModels array
+    Random RndQuantity(0,50);
+    CarDB cardb(MINPRIME, hashCode, DOUBLEHASH);
+    
+    Tester tester;
+    CarDB dbOne (MINPRIME, hashCode, QUADRATIC);
+    Car car1 ("Model1", 10, 1001, true);
+    Car car2 ("Model2", 20, 1002, true);
+    Car invalidCar ("Model", 10, MAXID + 1, true);
+    
+    if (tester.testInsertionCorrectBucket(dbOne, car1, car2)) {
+        cout << "Test - Correct Bucket is passed!" << endl;
+        
+    } else {
+        cout << "Test - Correct Bucket is failed!" << endl;
+    }
+    
+    CarDB dbTwo (MINPRIME, hashCode, QUADRATIC);
+    for (int i = 0; i < 10; i++){
+        Car dataObj = Car(carModels[RndCar.getRandNum()], RndQuantity.getRandNum(),
+                          RndID.getRandNum(), true);
+        dataList.push_back(dataObj);
+        if (!dbTwo.insert(dataObj)) cout << "Did not insert " << dataObj << endl;
+    }
+    
+    if (tester.testInsertionDataSize(dbTwo, dataList)) {
+        cout << "Test - Data Size Validation is passed!" << endl;
+    } else {
+        cout << "Test - Data Size Validation is failed!" << endl;
+    }
+    
+    CarDB dbThree (MINPRIME, hashCode, QUADRATIC);
+    Car car4 ("Model4", 12, 1002, true);
+    if (tester.testGetCarNonExistent(dbThree)) {
+        cout << "Test - GetCar Error Case is passed!" << endl;
+    } else {
+        cout << "Test - GetCar Error Case is failed!" << endl;
+    }
+    
+    CarDB dbFour (MINPRIME, hashCode, QUADRATIC);
+    if (tester.testGetCarNonColliding(dbFour)) {
+        cout << "Test - GetCar with several non-colliding keys is passed!" << endl;
+    } else {
+        cout << "Test - GetCar with several non-colliding keys is failed!" << endl;
+    }
+    
+    CarDB dbFive (MINPRIME, hashCode, QUADRATIC);
+    if (tester.testFindOperationWithCollision(dbFive)) {
+        cout << "Test - GetCar with several colliding keys without triggering a rehash is passed!" << endl;
+    } else {
+        cout << "Test - GetCar with several colliding keys without triggering a rehash is failed!" << endl;
+    }
+    
+    if (tester.testRemoveNonCollidingKeys()){
+        cout << "Test - Remove non colliding keys is passed!" << endl;
+    } else {
+        cout << "Test - Remove non colliding keys is failed!" << endl;
+    }
+    
+    if (tester.testRemoveCollidingKeys()){
+        cout << "Test - Remove colliding keys is passed!" << endl;
+    } else {
+        cout << "Test - Remove colliding keys is failed!" << endl;
+    }
+    
+    CarDB dbSix (MINPRIME, hashCode, QUADRATIC);
+    if (tester.testRehashTriggering(dbSix)) {
+        cout << "Test - Rehash triggering during insertion is passed!" << endl;
+    } else {
+        cout << "Test - Rehash triggering during insertion is failed!" << endl;
+    }
+    
+    CarDB dbSeven (MINPRIME, hashCode, QUADRATIC);
+    if (tester.testRehashCompletion(dbSeven)) {
+        cout << "Test - Rehash completion after insertion is passed!" << endl;
+    } else {
+        cout << "Test - Rehash completion after insertion is failed!" << endl;
+    }
+    
+    CarDB dbEight (MINPRIME, hashCode, QUADRATIC);
+    if (tester.testRehashTriggeringRemoval(dbEight)) {
+        cout << "Test - Rehash triggering during removal is passed!" << endl;
+    } else {
+        cout << "Test - Rehash triggering during removal is failed!" << endl;
+    }
+    
+    CarDB dbNine (MINPRIME, hashCode, QUADRATIC);
+    if (tester.testRehashCompletionRemoval(dbNine)) {
+        cout << "Test - Rehash completion after removal is passed!" << endl;
+    } else {
         cout << "Test - Rehash completion after removal is failed!" << endl;
     }
     
+    CarDB dbTen (MINPRIME, hashCode, DOUBLEHASH);
+    if (tester.testGrowthBeyondMaxPrime(dbTen)) {
+        cout << "Test - Growth beyond MAXPRIME is passed!" << endl;
+    } else {
+        cout << "Test - Growth beyond MAXPRIME is failed!" << endl;
+    }
+    
+    CarDB dbEleven (MINPRIME, hashCodeView, QUADRATIC);
+    if (tester.testViewLookup(dbEleven)) {
+        cout << "Test - Lookup by string_view is passed!" << endl;
+    } else {
+        cout << "Test - Lookup by string_view is failed!" << endl;
+    }
+    
+    CarDB dbTwelve (MINPRIME, hashCode, DOUBLEHASH);
+    if (tester.testControlBytes(dbTwelve)) {
+        cout << "Test - Control bytes match the buckets is passed!" << endl;
+    } else {
+        cout << "Test - Control bytes match the buckets is failed!" << endl;
+    }
+    
+    CarDB dbThirteen (MINPRIME, hashCode, GROUPED);
+    if (tester.testGroupedProbing(dbThirteen)) {
+        cout << "Test - Grouped probing at high load is passed!" << endl;
+    } else {
+        cout << "Test - Grouped probing at high load is failed!" << endl;
+    }
+    
+    CarDB dbFourteen (MINPRIME, hashCode, QUADRATIC);
+    if (tester.testMigrationBudget(dbFourteen)) {
+        cout << "Test - Migration budget per rehash step is passed!" << endl;
+    } else {
+        cout << "Test - Migration budget per rehash step is failed!" << endl;
+    }
+    
+    ConcurrentCarDB dbConcurrent (16, MINPRIME, hashCode, QUADRATIC);
+    if (tester.testConcurrentStress(dbConcurrent)) {
+        cout << "Test - Concurrent stress on sharded database is passed!" << endl;
+    } else {
+        cout << "Test - Concurrent stress on sharded database is failed!" << endl;
+    }
+    
+    ConcurrentCarDB dbOptimistic (4, MINPRIME, hashCode, QUADRATIC);
+    if (tester.testOptimisticReads(dbOptimistic)) {
+        cout << "Test - Lock-free reads during rehash is passed!" << endl;
+    } else {
+        cout << "Test - Lock-free reads during rehash is failed!" << endl;
+    }
+    
+    ConcurrentCarDB dbLongModels (4, MINPRIME, hashCode, QUADRATIC);
+    if (tester.testOptimisticLongModels(dbLongModels)) {
+        cout << "Test - Lock-free reads of long models and reader slot reuse is passed!" << endl;
+    } else {
+        cout << "Test - Lock-free reads of long models and reader slot reuse is failed!" << endl;
+    }
+    
+    ConcurrentCarDB dbSharedReads (4, MINPRIME, hashCode, GROUPED);
+    if (tester.testOptimisticReadsUnderWrites(dbSharedReads)) {
+        cout << "Test - Lock-free reads under every kind of write is passed!" << endl;
+    } else {
+        cout << "Test - Lock-free reads under every kind of write is failed!" << endl;
+    }
+    
+    CarDB dbFifteen (MINPRIME, hashCode, DOUBLEHASH);
+    if (tester.testInsertBatch(dbFifteen)) {
+        cout << "Test - Batch insert with a single resize is passed!" << endl;
+    } else {
+        cout << "Test - Batch insert with a single resize is failed!" << endl;
+    }
+    
+    CarDB dbSixteen (MINPRIME, hashCode, GROUPED);
+    if (tester.testGetCars(dbSixteen)) {
+        cout << "Test - Batched lookup of many keys is passed!" << endl;
+    } else {
+        cout << "Test - Batched lookup of many keys is failed!" << endl;
+    }
+    
+    CarDB dbSeventeen (MINPRIME, hashCode, QUADRATIC);
+    if (tester.testSnapshot(dbSeventeen)) {
+        cout << "Test - Snapshot save and mapped open is passed!" << endl;
+    } else {
+        cout << "Test - Snapshot save and mapped open is failed!" << endl;
+    }
+    
+    CarDB dbEighteen (MINPRIME, hashCode, DOUBLEHASH);
+    if (tester.testWriteAheadLog(dbEighteen)) {
+        cout << "Test - Write-ahead log recovery is passed!" << endl;
+    } else {
+        cout << "Test - Write-ahead log recovery is failed!" << endl;
+    }
+    
+    CarDB dbLogReplay (MINPRIME, hashCode, DOUBLEHASH);
+    if (tester.testLogReplay(dbLogReplay)) {
+        cout << "Test - Log replay of duplicates, snapshot overlap and failures is passed!" << endl;
+    } else {
+        cout << "Test - Log replay of duplicates, snapshot overlap and failures is failed!" << endl;
+    }
+    
+    CarDB dbNineteen (MINPRIME, hashCode, QUADRATIC);
+    if (tester.testDealerIndex(dbNineteen)) {
+        cout << "Test - Dealer index through rehash and removal is passed!" << endl;
+    } else {
+        cout << "Test - Dealer index through rehash and removal is failed!" << endl;
+    }
+    
+    CarDB dbTwenty (MINPRIME, hashCode, DOUBLEHASH);
+    if (tester.testModelTotals(dbTwenty)) {
+        cout << "Test - Model totals through updates and removal is passed!" << endl;
+    } else {
+        cout << "Test - Model totals through updates and removal is failed!" << endl;
+    }
+    
+    CarDB dbTwentyOne (MINPRIME, hashCode, QUADRATIC);
+    if (tester.testMigrationLookup(dbTwentyOne)) {
+        cout << "Test - Lookups on both sides of the migration cursor is passed!" << endl;
+    } else {
+        cout << "Test - Lookups on both sides of the migration cursor is failed!" << endl;
+    }
+    
+    CarDB dbTwentyTwo (MINPRIME, wyHash, DOUBLEHASH);
+    if (tester.testWyHash(dbTwentyTwo)) {
+        cout << "Test - Built-in wyHash as the table hash is passed!" << endl;
+    } else {
+        cout << "Test - Built-in wyHash as the table hash is failed!" << endl;
+    }
+    
+    if (tester.testProbeSequence(QUADRATIC) && tester.testProbeSequence(DOUBLEHASH)) {
+        cout << "Test - Compiled probe loops follow probeIndex is passed!" << endl;
+    } else {
+        cout << "Test - Compiled probe loops follow probeIndex is failed!" << endl;
+    }
+    
+    CarDB dbMigrationFull (MINPRIME, hashCode, QUADRATIC);
+    if (tester.testMigrationFull(dbMigrationFull)) {
+        cout << "Test - Migration into a full table keeps its cars is passed!" << endl;
+    } else {
+        cout << "Test - Migration into a full table keeps its cars is failed!" << endl;
+    }
+    
+    if (tester.testTableAllocator(QUADRATIC) && tester.testTableAllocator(ROBINHOOD)) {
+        cout << "Test - Tables from the allocator given to the constructor is passed!" << endl;
+    } else {
+        cout << "Test - Tables from the allocator given to the constructor is failed!" << endl;
+    }
+    
+    CarDB dbTwentyThree (MINPRIME, hashCode, QUADRATIC);
+    if (tester.testRobinHood(dbTwentyThree)) {
+        cout << "Test - Robin Hood churn without deleted buckets is passed!" << endl;
+    } else {
+        cout << "Test - Robin Hood churn without deleted buckets is failed!" << endl;
+    }
+    
+    CarDB dbRobinHoodUsed (MINPRIME, hashCode, ROBINHOOD);
+    if (tester.testRobinHoodPlacement(dbRobinHoodUsed)) {
+        cout << "Test - Robin Hood displacement keeps cars used is passed!" << endl;
+    } else {
+        cout << "Test - Robin Hood displacement keeps cars used is failed!" << endl;
+    }
+    
+    CarDB dbTwentyFour (MINPRIME, hashCode, DOUBLEHASH);
+    if (tester.testStats(dbTwentyFour)) {
+        cout << "Test - Stats counters and JSON dump is passed!" << endl;
+    } else {
+        cout << "Test - Stats counters and JSON dump is failed!" << endl;
+    }
+    
+    CarDB dbTwentyFive (MINPRIME, hashCode, QUADRATIC);
+    if (tester.testNegativeLookup(dbTwentyFive)) {
+        cout << "Test - Misses stop at empty buckets and the filter is passed!" << endl;
+    } else {
+        cout << "Test - Misses stop at empty buckets and the filter is failed!" << endl;
+    }
+    
+    CarDB dbTwentySix (MINPRIME, hashCode, QUADRATIC);
+    if (tester.testUpsert(dbTwentySix)) {
+        cout << "Test - Upsert and adjustQuantity is passed!" << endl;
+    } else {
+        cout << "Test - Upsert and adjustQuantity is failed!" << endl;
+    }
+    
+    ConcurrentCarDB dbAdjust (4, MINPRIME, hashCode, DOUBLEHASH);
+    if (tester.testConcurrentAdjust(dbAdjust)) {
+        cout << "Test - Concurrent adjustQuantity is passed!" << endl;
+    } else {
+        cout << "Test - Concurrent adjustQuantity is failed!" << endl;
+    }
+    
+    ConcurrentCarDB dbWorker (4, MINPRIME, hashCode, GROUPED);
+    if (tester.testMigrationWorker(dbWorker)) {
+        cout << "Test - Background migration worker is passed!" << endl;
+    } else {
+        cout << "Test - Background migration worker is failed!" << endl;
+    }
+    
+    CarDB dbTwentySeven (MINPRIME, hashCode, QUADRATIC);
+    if (tester.testTrace(dbTwentySeven)) {
+        cout << "Test - Trace recording and replay is passed!" << endl;
+    } else {
+        cout << "Test - Trace recording and replay is failed!" << endl;
+    }
+    
     return 0;
 }
-
-unsigned int hashCode(const string str) {
-   unsigned int val = 0 ;
-   const unsigned int thirtyThree = 33 ;  // magic number from textbook
-   for (unsigned int i = 0 ; i < str.length(); i++)
-      val = val * thirtyThree + str[i] ;
-   return val ;
-}
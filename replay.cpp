@@ -0,0 +1,231 @@
+/**********************************************
+ ** File: replay.cpp
+ ** Project: CMSC 341 Project 4
+ **
+ ** This file replays a trace written by CarDB::startTrace against a database of any configuration,
+ ** issuing each call at its recorded time and timing it.
+ ** Build: g++ -std=c++17 -O2 dealer.cpp replay.cpp -o replay -lpthread
+ ** Usage: replay trace [--policy QUADRATIC|DOUBLEHASH|GROUPED|ROBINHOOD] [--hash hashCode|hashCodeView|wyHash]
+ **               [--capacity 101] [--speed 1] [--filter on|off] [--output replay_output.txt]
+ ** The policy and capacity default to the recorded ones. --speed 2 issues the calls twice as fast,
+ ** --speed 0 issues each call as soon as the previous one returns.
+ ** Every replay appends one JSON line to the output file, the same results are printed as a table.
+ ************************************************************************/
+
+#include "dealer.h"
+#include "hashcode.h"
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <algorithm>
+#include <stdexcept>
+
+const int NUMTRACEOPS = TRACEBATCH + 1; // latencies are kept per trace_t, index 0 is unused
+const char* TRACEOPNAMES[NUMTRACEOPS] = {"", "insert", "remove", "getCar", "updateQuantity", "upsert",
+                                          "adjustQuantity", "changeProbPolicy", "insertBatch"};
+const long long SPINNANOS = 1000000; // the last stretch before a call is spun, since sleeps overshoot
+
+// Settings of a replay, filled in from the command line
+struct ReplayConfig{
+    string m_trace;
+    string m_policy;                   // empty for the recorded policy
+    string m_hash = "hashCode";
+    int    m_capacity = 0;             // 0 for the recorded capacity
+    double m_speed = 1;                // 0 replays without waiting
+    bool   m_filter = false;
+    string m_output = "replay_output.txt";
+};
+
+// Latencies of one kind of call, in nanoseconds
+struct CallLatencies{
+    vector<float> m_service;  // from the start of the call to its return
+    vector<float> m_response; // from the recorded time of the call to its return, includes falling behind the trace
+    long long m_mismatches = 0; // calls whose result differs from the recorded one
+};
+
+// percentile(vector<float>& nanos, double fraction)
+// Sorts the latencies and returns the one below which the fraction of them fall
+static float percentile(vector<float>& nanos, double fraction) {
+    if (nanos.empty()) {
+        return 0;
+    }
+    sort(nanos.begin(), nanos.end());
+    return nanos[static_cast<size_t>(fraction * (nanos.size() - 1))];
+}
+
+// parsePolicy(const string& name, prob_t& policy)
+// Returns false if the name is not a policy
+static bool parsePolicy(const string& name, prob_t& policy) {
+    const char* names[] = {"NONE", "QUADRATIC", "DOUBLEHASH", "GROUPED", "ROBINHOOD"};
+    for (int i = 0; i <= ROBINHOOD; i++) {
+        if (name == names[i]) {
+            policy = static_cast<prob_t>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+// policyName(prob_t policy)
+// Returns the name of the policy as written in the results
+static string policyName(prob_t policy) {
+    const char* names[] = {"NONE", "QUADRATIC", "DOUBLEHASH", "GROUPED", "ROBINHOOD"};
+    return policy >= NONE && policy <= ROBINHOOD ? names[policy] : "NONE";
+}
+
+// makeDB(const string& hash, int capacity, prob_t policy)
+// Creates an empty database with the named hash function, nullptr if the name is unknown
+static CarDB* makeDB(const string& hash, int capacity, prob_t policy) {
+    if (hash == "hashCode") {
+        return new CarDB(capacity, hashCode, policy);
+    } else if (hash == "hashCodeView") {
+        return new CarDB(capacity, hashCodeView, policy);
+    } else if (hash == "wyHash") {
+        return new CarDB(capacity, wyHash, policy);
+    }
+    return nullptr;
+}
+
+// parseArgs(int argc, char** argv, ReplayConfig& config)
+// Reads the command line into config, returns false on an unknown or malformed option
+static bool parseArgs(int argc, char** argv, ReplayConfig& config) {
+    if (argc < 2 || argc % 2 != 0) {
+        return false;
+    }
+    config.m_trace = argv[1];
+    
+    // stoi and stod throw on a value that is not a number or out of range
+    try {
+        for (int i = 2; i + 1 < argc; i += 2) {
+            string option = argv[i];
+            string value = argv[i + 1];
+            prob_t policy;
+            if (option == "--policy" && parsePolicy(value, policy)) {
+                config.m_policy = value;
+            } else if (option == "--hash") {
+                config.m_hash = value;
+            } else if (option == "--capacity") {
+                config.m_capacity = stoi(value);
+            } else if (option == "--speed" && stod(value) >= 0) {
+                config.m_speed = stod(value);
+            } else if (option == "--filter" && (value == "on" || value == "off")) {
+                config.m_filter = value == "on";
+            } else if (option == "--output") {
+                config.m_output = value;
+            } else {
+                return false;
+            }
+        }
+    } catch (const invalid_argument&) {
+        return false;
+    } catch (const out_of_range&) {
+        return false;
+    }
+    return true;
+}
+
+// waitUntil(chrono::steady_clock::time_point when)
+// Sleeps until shortly before the time, then spins so the call starts on time
+static void waitUntil(chrono::steady_clock::time_point when) {
+    if (when - chrono::steady_clock::now() > chrono::nanoseconds(2 * SPINNANOS)) {
+        this_thread::sleep_until(when - chrono::nanoseconds(SPINNANOS));
+    }
+    while (chrono::steady_clock::now() < when) {
+    }
+}
+
+int main(int argc, char** argv) {
+    ReplayConfig config;
+    if (!parseArgs(argc, argv, config)) {
+        cout << "Usage: replay trace [--policy QUADRATIC|DOUBLEHASH|GROUPED|ROBINHOOD] [--hash hashCode|hashCodeView|wyHash]" << endl
+             << "              [--capacity 101] [--speed 1] [--filter on|off] [--output replay_output.txt]" << endl;
+        return 1;
+    }
+    TraceInfo info;
+    vector<TraceRecord> records;
+    if (!CarDB::loadTrace(config.m_trace, info, records)) {
+        cout << "Cannot read the trace " << config.m_trace << endl;
+        return 1;
+    }
+    prob_t policy = info.m_policy;
+    if (!config.m_policy.empty()) {
+        parsePolicy(config.m_policy, policy);
+    }
+    int capacity = config.m_capacity > 0 ? config.m_capacity : info.m_capacity;
+    CarDB* db = makeDB(config.m_hash, capacity, policy);
+    if (!db) {
+        cout << "Unknown hash function " << config.m_hash << endl;
+        return 1;
+    }
+    db->useFilter(config.m_filter);
+    ofstream results(config.m_output, ios::app);
+    if (!results) {
+        cout << "Cannot open " << config.m_output << endl;
+        delete db;
+        return 1;
+    }
+
+    // Each call starts at its recorded time scaled by the speed, or right after the previous one at speed 0
+    CallLatencies latencies[NUMTRACEOPS];
+    vector<float> lateness; // how much later than scheduled the calls started
+    lateness.reserve(records.size());
+    auto start = chrono::steady_clock::now();
+    for (const TraceRecord& record : records) {
+        auto begin = chrono::steady_clock::now();
+        auto scheduled = begin;
+        if (config.m_speed > 0) {
+            scheduled = start + chrono::nanoseconds(static_cast<long long>(record.m_nanos / config.m_speed));
+            waitUntil(scheduled);
+            begin = chrono::steady_clock::now();
+        }
+        int previous = 0;
+        bool found = false;
+        int result = db->replayCall(record, &previous, &found);
+        auto end = chrono::steady_clock::now();
+
+        CallLatencies& latency = latencies[record.m_op < NUMTRACEOPS ? record.m_op : 0];
+        latency.m_service.push_back(chrono::duration<float, nano>(end - begin).count());
+        latency.m_response.push_back(chrono::duration<float, nano>(end - scheduled).count());
+        latency.m_mismatches += result != record.m_result || previous != record.m_previous || found != record.m_found;
+        lateness.push_back(chrono::duration<float, nano>(begin - scheduled).count());
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    double traceSeconds = records.empty() ? 0 : records.back().m_nanos / 1e9;
+    delete db;
+
+    // Table, then the JSON line
+    cout << "Trace: " << config.m_trace << ", " << records.size() << " calls over " << traceSeconds << " s, replayed in "
+         << seconds << " s with " << policyName(policy) << ", " << config.m_hash << ", capacity " << capacity
+         << ", speed " << config.m_speed << endl;
+    cout << "call              count  mismatches   svc p50   svc p99  svc p999   svc max   rsp p99 (ns)" << endl;
+    ostringstream json;
+    json << "{\"trace\":\"" << config.m_trace << "\",\"policy\":\"" << policyName(policy) << "\",\"hash\":\""
+         << config.m_hash << "\",\"capacity\":" << capacity << ",\"speed\":" << config.m_speed
+         << ",\"filter\":" << (config.m_filter ? "true" : "false") << ",\"calls\":" << records.size()
+         << ",\"traceSeconds\":" << traceSeconds << ",\"replaySeconds\":" << seconds
+         << ",\"latenessP99\":" << percentile(lateness, 0.99) << ",\"latenessMax\":" << percentile(lateness, 1.0);
+    long long mismatches = 0;
+    for (int op = 1; op < NUMTRACEOPS; op++) {
+        CallLatencies& latency = latencies[op];
+        if (latency.m_service.empty()) {
+            continue;
+        }
+        mismatches += latency.m_mismatches;
+        float service[] = {percentile(latency.m_service, 0.5), percentile(latency.m_service, 0.99),
+                           percentile(latency.m_service, 0.999), percentile(latency.m_service, 1.0)};
+        float response = percentile(latency.m_response, 0.99);
+        char line[256];
+        snprintf(line, sizeof(line), "%-16s %6zu %11lld %9.0f %9.0f %9.0f %9.0f %9.0f", TRACEOPNAMES[op],
+                 latency.m_service.size(), latency.m_mismatches, service[0], service[1], service[2], service[3], response);
+        cout << line << endl;
+        json << ",\"" << TRACEOPNAMES[op] << "\":{\"count\":" << latency.m_service.size()
+             << ",\"mismatches\":" << latency.m_mismatches << ",\"p50\":" << service[0] << ",\"p99\":" << service[1]
+             << ",\"p999\":" << service[2] << ",\"max\":" << service[3] << ",\"responseP99\":" << response << "}";
+    }
+    json << ",\"mismatches\":" << mismatches << "}";
+    results << json.str() << endl;
+    cout << "Calls started late by p99 " << percentile(lateness, 0.99) << " ns, " << mismatches
+         << " results differ from the recording" << endl;
+    return 0;
+}